@@ -18,8 +18,11 @@
 #ifndef CSC369_EXT2_FS_H
 #define CSC369_EXT2_FS_H
 
-/* The ext2 block size used in the assignment. */
-#define EXT2_BLOCK_SIZE 1024
+/* The smallest ext2 block size, the actual one is
+ * EXT2_MIN_BLOCK_SIZE << s_log_block_size. */
+#define EXT2_MIN_BLOCK_SIZE 1024
+/* The super block is always at this offset, whatever the block size. */
+#define EXT2_SUPER_BLOCK_OFFSET 1024
 
 /*
  * Structure of the super block
@@ -86,7 +89,7 @@ struct ext2_super_block {
 	 */
 	unsigned char  s_prealloc_blocks;     /* Nr of blocks to try to preallocate*/
 	unsigned char  s_prealloc_dir_blocks; /* Nr to preallocate for dirs */
-	unsigned short s_padding1;
+	unsigned short s_reserved_gdt_blocks; /* Per group reserved for growth */
 	/*
 	 * Journaling support valid if EXT3_FEATURE_COMPAT_HAS_JOURNAL set.
 	 */
@@ -100,9 +103,28 @@ struct ext2_super_block {
 	unsigned short s_reserved_word_pad;
 	unsigned int   s_default_mount_opts;
 	unsigned int   s_first_meta_bg; /* First metablock block group */
-	unsigned int   s_reserved[190]; /* Padding to the end of the block */
+	unsigned int   s_mkfs_time;     /* When the filesystem was created */
+	unsigned int   s_jnl_blocks[17]; /* Backup of the journal inode */
+	unsigned int   s_reserved_hi[4]; /* 64-bit counts, not used by ext2 */
+	unsigned int   s_flags;         /* Miscellaneous flags */
+	unsigned int   s_reserved[167]; /* Padding to the end of the block */
 };
 
+/* Compatible feature set when directories may be hash indexed (htree) */
+#define EXT2_FEATURE_COMPAT_DIR_INDEX 0x0020
+
+/* s_flags: whether the directory hashes treat chars as signed or unsigned */
+#define EXT2_FLAGS_SIGNED_HASH   0x0001
+#define EXT2_FLAGS_UNSIGNED_HASH 0x0002
+
+
+/* Read-only compatible feature set when only some groups back up the
+ * super block and the descriptors: 0, 1 and the powers of 3, 5 and 7 */
+#define EXT2_FEATURE_RO_COMPAT_SPARSE_SUPER 0x0001
+
+/* Read-only compatible feature set when files of 2 GiB or more exist */
+#define EXT2_FEATURE_RO_COMPAT_LARGE_FILE 0x0002
+
 
 /*
  * Structure of a blocks group descriptor
@@ -121,6 +143,15 @@ struct ext2_group_desc
 };
 
 
+/*
+ * Constants relative to the data blocks
+ */
+#define EXT2_NDIR_BLOCKS 12
+#define EXT2_IND_BLOCK   EXT2_NDIR_BLOCKS
+#define EXT2_DIND_BLOCK  (EXT2_IND_BLOCK + 1)
+#define EXT2_TIND_BLOCK  (EXT2_DIND_BLOCK + 1)
+#define EXT2_N_BLOCKS    (EXT2_TIND_BLOCK + 1)
+
 /*
  * Structure of an inode on the disk
  */
@@ -149,12 +180,17 @@ struct ext2_inode {
 	unsigned int   i_generation;  /* File version (for NFS) */
 	/* The following fields should be 0 for the assignment.  */
 	unsigned int   i_file_acl;    /* File ACL */
-	unsigned int   i_dir_acl;     /* Directory ACL */
+	unsigned int   i_dir_acl;     /* Directory ACL, high 32 bits of the
+	                                 size for regular files */
 	unsigned int   i_faddr;       /* Fragment address */
 	unsigned int   extra[3];
 };
 
 
+/* i_flags: the directory has a hash index (htree) */
+#define EXT2_INDEX_FL 0x00001000
+
+
 /*
  * Type field for file mode
  */
@@ -212,4 +248,45 @@ struct ext2_dir_entry {
 
 #define    EXT2_FT_MAX      8
 
+
+/*
+ * Structures of a hash indexed (htree) directory. Its block 0 is a dx_root:
+ * a "." entry and a ".." entry whose rec_len covers the rest of the block,
+ * then a dx_root_info and an array of dx_entry. With indirect_levels 1, the
+ * dx_entry point to dx_node blocks: an empty entry covering the whole block
+ * (inode 0, rec_len the block size), then another array of dx_entry. The
+ * last level of dx_entry point to ordinary directory blocks (leaves). A
+ * dx_entry maps the names hashing to at least hash, up to the hash of the
+ * next entry, to the logical block in block. The hash of the first entry of
+ * an array is implied by its parent and holds a dx_countlimit instead.
+ */
+struct dx_root_info {
+	unsigned int   reserved_zero;
+	unsigned char  hash_version;    /* DX_HASH_* */
+	unsigned char  info_length;     /* 8 */
+	unsigned char  indirect_levels; /* 0 or 1 */
+	unsigned char  unused_flags;
+};
+
+struct dx_entry {
+	unsigned int   hash;
+	unsigned int   block;
+};
+
+struct dx_countlimit {
+	unsigned short limit;  /* Room for this many dx_entry */
+	unsigned short count;  /* Number of dx_entry in use */
+};
+
+/*
+ * Hash versions. The unsigned variants are not stored in dx_root_info, but
+ * used instead of the first three when s_flags has EXT2_FLAGS_UNSIGNED_HASH.
+ */
+#define DX_HASH_LEGACY            0
+#define DX_HASH_HALF_MD4          1
+#define DX_HASH_TEA               2
+#define DX_HASH_LEGACY_UNSIGNED   3
+#define DX_HASH_HALF_MD4_UNSIGNED 4
+#define DX_HASH_TEA_UNSIGNED      5
+
 #endif
@@ -0,0 +1,105 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include "path.h"
+#include "ops.h"
+#include "ext2.h"
+
+
+unsigned char *disk;
+
+#define MAX_ARGS 4
+
+/**
+ * Run the command in args (count tokens), returning the result of its
+ * operation. Return 1 for an unknown command or a wrong number of arguments.
+ */
+int run_command(char **args, int count);
+
+int main(int argc, char** argv) {
+
+    if(argc != 2 && argc != 3) {
+        fprintf(stderr, "Usage: ext2_batch <image file name> [command file]\n");
+        exit(1);
+    }
+
+    // read the commands from the file, or from stdin if there is none
+    FILE *script = stdin;
+    if (argc == 3) {
+        script = fopen(argv[2], "r");
+        if (script == NULL) {
+            perror("fopen");
+            exit(1);
+        }
+    }
+
+    // open disk image once for all the commands
+    int fd = open_image(argv[1], IMAGE_RANDOM);
+
+    // one command per line: mkdir <path>, cp <source> <dest>,
+    // ln [-s] <source> <dest>, rm <path>, restore <path> or
+    // compact [-s name|hash] <path>;
+    // empty lines and lines starting with # are skipped
+    char *line = NULL;
+    size_t capacity = 0;
+    int line_number = 0;
+    int result = 0;
+    while (getline(&line, &capacity, script) != -1) {
+        line_number++;
+        char *args[MAX_ARGS + 1];
+        int count = 0;
+        char *token = strtok(line, " \t\r\n");
+        while (token != NULL && count <= MAX_ARGS) {
+            args[count++] = token;
+            token = strtok(NULL, " \t\r\n");
+        }
+        if (count == 0 || args[0][0] == '#') {
+            continue;
+        }
+
+        // stop at the first command that fails, keeping what was done
+        result = run_command(args, count);
+        if (result != 0) {
+            fprintf(stderr, "ext2_batch: line %d: %s failed\n", line_number, args[0]);
+            break;
+        }
+    }
+    free(line);
+    if (script != stdin) {
+        fclose(script);
+    }
+
+    // write back everything the commands changed at once
+    sync_changes();
+    close(fd);
+    return result;
+}
+
+
+// find the operation of the command and run it
+int run_command(char **args, int count) {
+    if (strcmp(args[0], "mkdir") == 0 && count == 2) {
+        return op_mkdir(args[1]);
+    } else if (strcmp(args[0], "cp") == 0 && count == 3) {
+        return op_cp(args[1], args[2]);
+    } else if (strcmp(args[0], "ln") == 0 && count == 3) {
+        return op_ln(args[1], args[2], 0);
+    } else if (strcmp(args[0], "ln") == 0 && count == 4 && strcmp(args[1], "-s") == 0) {
+        return op_ln(args[2], args[3], 1);
+    } else if (strcmp(args[0], "rm") == 0 && count == 2) {
+        return op_rm(args[1]);
+    } else if (strcmp(args[0], "restore") == 0 && count == 2) {
+        return op_restore(args[1]);
+    } else if (strcmp(args[0], "compact") == 0 && count == 2) {
+        return op_compact_dir(args[1], COMPACT_KEEP_ORDER);
+    } else if (strcmp(args[0], "compact") == 0 && count == 4 && strcmp(args[1], "-s") == 0) {
+        if (strcmp(args[2], "name") == 0) {
+            return op_compact_dir(args[3], COMPACT_BY_NAME);
+        } else if (strcmp(args[2], "hash") == 0) {
+            return op_compact_dir(args[3], COMPACT_BY_HASH);
+        }
+    }
+    fprintf(stderr, "Unknown command or wrong arguments: %s\n", args[0]);
+    return 1;
+}
@@ -8,317 +8,1295 @@
 #include <errno.h>
 #include <assert.h>
 #include <string.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <getopt.h>
+#include <stdarg.h>
+#include <time.h>
 #include "path.h"
 #include "ext2.h"
 
 
 unsigned char *disk;
 struct ext2_super_block *sb;
-struct ext2_group_desc *bd;
-struct ext2_inode *inodes;
-unsigned char *block_bitmap;
-unsigned char *inode_bitmap;
 
 // counter for fixes
 int counter = 0;
 
-// Count used blocks according to bitmap
-int count_block();
+// number of threads checking the image, set by -j
+int jobs = 1;
 
-// Count used inodes according to bitmap
-int count_inode();
+// set by --dry-run: the image is mapped privately so nothing reaches it, and
+// what would be fixed is printed as JSON instead of the usual messages
+int dry_run = 0;
 
-/* loop over the block used by a directory corresponding to an inode
- * index: index of inode (inode number - 1) 
+// entries referring to each inode (by number), counted in the directory
+// sweep of a full check
+uint16_t *links;
+
+// time of each phase of the check, for --dry-run
+#define MAX_PHASES 8
+struct {
+    const char *name;
+    double ms;
+} phases[MAX_PHASES];
+int phase_count = 0;
+struct timespec phase_start;
+
+// kinds of problems the threads find, fixed afterwards one at a time
+#define FIND_TYPE 0      // entry type vs inode mismatch
+#define FIND_INODE 1     // inode in use not marked in the bitmap
+#define FIND_DTIME 2     // valid inode marked for deletion
+#define FIND_BLOCKS 3    // blocks of an inode not marked in the bitmap
+
+struct finding {
+    int kind;
+    int inode;
+    int count;                      // FIND_BLOCKS: number of blocks
+    struct ext2_dir_entry *entry;   // FIND_TYPE: entry to fix
+    unsigned char file_type;        // FIND_TYPE: its right type
+};
+
+/**
+ * What one thread works on, items start to end of the current phase, and
+ * what it finds: its problems, the directories it runs into and, for the
+ * block bitmap, a private shadow bitmap of the blocks it saw in use (bit
+ * block - s_first_data_block).
+ */
+struct worker {
+    pthread_t thread;
+    int start;
+    int end;
+    unsigned int *items;
+    struct finding *findings;
+    int finding_count;
+    int finding_capacity;
+    unsigned int *directories;
+    int directory_count;
+    int directory_capacity;
+    unsigned char *shadow;
+    int *used_blocks;
+    int *used_inodes;
+};
+
+/* Run fn on jobs threads, each on its share of total items.
+ * workers: one per thread, their ranges are filled in here
+ */
+void run_workers(struct worker *workers, int total, void *(*fn)(void*));
+
+// Count the used blocks and inodes of the groups of a worker
+void *count_groups(void *arg);
+
+// Check the entries in the directory blocks of a worker
+void *check_blocks(void *arg);
+
+// Check the blocks of the inodes of a worker against the block bitmap
+void *check_inode_blocks(void *arg);
+
+/* Check imode, inode bitmap and i_dtime for the entries reachable from the
+ * root, breadth first: a level of the directory tree at a time, its blocks
+ * in disk order split across the threads, fixing what they find between
+ * levels. Each directory is checked once, whatever the number of entries
+ * leading to it.
  */
-void check_directory(int index);
+void check_directories(struct worker *workers);
 
-/* loop over the files in a block and check imode, inode bitmap and i_dtime
- * block: index of block
+/* Compare the entries counted for each inode with its i_links_count, in
+ * one pass over the inode table, fixing the link counts that are off and
+ * releasing the inodes in use that no entry refers to
  */
-void check_block(int block);
+void check_link_counts();
+
+// Check the block bitmap for every inode in use with jobs threads
+void check_data_blocks_parallel(struct worker *workers);
+
+/* Build bitmaps of the blocks and inodes referenced by the inode table, in
+ * one pass over it, then compare them with the bitmaps of the image a word
+ * at a time, fixing missing and leaked bits and reporting the blocks used
+ * more than once
+ */
+void check_bitmaps_shadow();
+
+// Count used blocks in a group according to its bitmap
+int count_block(int group);
+
+// Count used inodes in a group according to its bitmap
+int count_inode(int group);
 
 
 /* Helper function to check consistency of block bitmap
- * index : inode index in bitmap
+ * index : inode index in bitmap (inode number - 1)
  */
 void check_data_block(int index);
 
+/* Print one finding of --dry-run as a JSON object in the findings array
+ * format : printf format of the members of the object, without the braces
+ */
+void print_finding(const char *format, ...);
+
+/* Note the time since the end of the previous phase, or the start, as the
+ * time of the phase name, for --dry-run
+ */
+void end_phase(const char *name);
+
+/* Fix the free counters of a group
+ * used_blocks, used_inodes : blocks and inodes in use by its bitmaps
+ */
+void fix_group_counters(int g, int used_blocks, int used_inodes);
+
+/* Fix the free counters of the super block
+ * free_blocks_count, free_inodes_count : the totals of the groups
+ */
+void fix_super_counters(int free_blocks_count, int free_inodes_count);
+
+// Check the whole image: counters, directories, link counts and bitmaps
+void check_image(struct worker *workers, int shadow);
+
+/* Check only what the dirty log of the image names: the counters of the
+ * groups it touches, the entries of the directories changed, and the
+ * bitmap bits of the inodes and block runs allocated or released, against
+ * the blocks of the inodes named. Blocks named that are in use but owned by
+ * no inode named are reported, not released: only a full check with
+ * --shadow can tell. Return the number of these blocks
+ */
+int check_incremental(struct worker *workers);
+
 
 
 int main(int argc, char** argv) {
+
+    int opt;
+    int bad_option = 0;
+    int shadow = 0;
+    int incremental = 0;
+    static struct option options[] = {
+        {"jobs", required_argument, NULL, 'j'},
+        {"shadow", no_argument, NULL, 's'},
+        {"dry-run", no_argument, NULL, 'n'},
+        {"incremental", no_argument, NULL, 'i'},
+        {NULL, 0, NULL, 0}
+    };
+
+    // number of threads to check with, and how to check the bitmaps
+    while ((opt = getopt_long(argc, argv, "j:sni", options, NULL)) != -1){
+        if (opt == 'j' && atoi(optarg) > 0) {
+            jobs = atoi(optarg);
+        } else if (opt == 's') {
+            shadow = 1;
+        } else if (opt == 'n') {
+            dry_run = 1;
+        } else if (opt == 'i') {
+            incremental = 1;
+        } else {
+            bad_option = 1;
+        }
+    }
+
+    if(bad_option || argc - optind != 1) {
+        fprintf(stderr, "Usage: ext2_checker (-j N) (-s) (-n) (-i) <image file name>\n");
+        exit(1);
+    }
+
+    // open image file, only a private copy of it for a dry run; an
+    // incremental check only looks at a few places. The repairs are not
+    // logged: the log is cleared once they are made
+    int access = (incremental ? IMAGE_RANDOM : IMAGE_SEQUENTIAL) | IMAGE_UNLOGGED;
+    open_image(argv[optind], dry_run ? access | IMAGE_PRIVATE : access);
+    clock_gettime(CLOCK_MONOTONIC, &phase_start);
+    if (dry_run) {
+        printf("{\n  \"findings\": [");
+    }
+
+    sb = get_super_block();
+    struct worker *workers = calloc(jobs, sizeof(struct worker));
+    if (workers == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+
+
+    // only what the dirty log names, or the whole image
+    int unsettled = 0;
+    if (incremental) {
+        unsettled = check_incremental(workers);
+    } else {
+        check_image(workers, shadow);
+    }
+    for (int t = 0; t < jobs; t++) {
+        free(workers[t].findings);
+        free(workers[t].directories);
+    }
+    free(workers);
     
-    if(argc != 2) {
-        fprintf(stderr, "Usage: ext2_checker <image file name>");
+    // Summary of fixes
+    if (dry_run) {
+        printf("\n  ],\n  \"phases\": {");
+        for (int p = 0; p < phase_count; p++) {
+            printf(p == 0 ? "\"%s\": %.3f" : ", \"%s\": %.3f", phases[p].name, phases[p].ms);
+        }
+        printf("},\n  \"inconsistencies\": %d\n}\n", counter);
+    }else if(counter == 0){
+        printf("No file system inconsistencies detected!\n");
+    }else{
+        printf("%d file system inconsistencies repaired!\n", counter);
+    }
+
+    // write back the repairs before the log naming what they settle goes
+    if (!dry_run) {
+        sync_changes();
+    }
+
+    // what the log named has been checked, and the rest of the image with
+    // a full check; a dry run leaves the log for the real one, and an
+    // incremental check that found blocks it cannot settle leaves it for
+    // the next one
+    if (!dry_run && unsettled == 0) {
+        clear_dirty_log();
+    }
+    
+    return 0;
+}
+
+
+
+// check the whole image, a phase at a time
+void check_image(struct worker *workers, int shadow) {
+    int group_count = get_group_count();
+
+    // count used blocks and inodes, group by group
+    int *used_blocks = malloc(sizeof(int) * group_count);
+    int *used_inodes = malloc(sizeof(int) * group_count);
+    if (used_blocks == NULL || used_inodes == NULL) {
+        perror("malloc");
         exit(1);
     }
+    if (jobs == 1) {
+        for (int g = 0; g < group_count; g++) {
+            used_blocks[g] = count_block(g);
+            used_inodes[g] = count_inode(g);
+        }
+    } else {
+        for (int t = 0; t < jobs; t++) {
+            workers[t].used_blocks = used_blocks;
+            workers[t].used_inodes = used_inodes;
+        }
+        run_workers(workers, group_count, count_groups);
+    }
 
-    // open image file
-    int fd = open(argv[1], O_RDWR);
-	if(fd == -1) {
-		perror("open");
-		exit(1);
+    // check free blocks and inodes count, group by group
+    int free_blocks_count = 0;
+    int free_inodes_count = 0;
+    for (int g = 0; g < group_count; g++) {
+        fix_group_counters(g, used_blocks[g], used_inodes[g]);
+        free_blocks_count += blocks_in_group(g) - used_blocks[g];
+        free_inodes_count += sb->s_inodes_per_group - used_inodes[g];
     }
+    free(used_blocks);
+    free(used_inodes);
+    fix_super_counters(free_blocks_count, free_inodes_count);
+    end_phase("counters");
 
-    disk = mmap(NULL, 128 * 1024, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-    if(disk == MAP_FAILED) {
-        perror("mmap");
+    
+    // check i_mode, i_node bitmap and i_dtime, counting the entries of
+    // each inode on the way
+    links = calloc((size_t)sb->s_inodes_count + 1, sizeof(uint16_t));
+    if (links == NULL) {
+        perror("calloc");
         exit(1);
     }
+    check_directories(workers);
+    end_phase("directories");
 
-    sb = (struct ext2_super_block *)(disk + EXT2_BLOCK_SIZE);
-    bd = (struct ext2_group_desc *)(disk + (EXT2_BLOCK_SIZE) * 2);
-    inodes = (struct ext2_inode*)(disk + (EXT2_BLOCK_SIZE)*bd->bg_inode_table);
-    block_bitmap = (unsigned char *)(disk + EXT2_BLOCK_SIZE * bd->bg_block_bitmap);
-    inode_bitmap = (unsigned char *)(disk + EXT2_BLOCK_SIZE * bd->bg_inode_bitmap);
+    // check i_links_count
+    check_link_counts();
+    free(links);
+    end_phase("links");
 
 
+    // check consistency of block bitmap
+    if (shadow) {
+        check_bitmaps_shadow();
+    } else if (jobs == 1) {
+        for (int g = 0; g < group_count; g++) {
+            unsigned char *inode_bitmap = disk + block_size * get_group_desc(g)->bg_inode_bitmap;
+            for(int byte = 0; byte < sb->s_inodes_per_group / 8; byte++){
+                for (int bit = 0; bit < 8; bit++){
+                    unsigned char in_use = inode_bitmap[byte] & (1 << bit);
+                    if(in_use){
+                        check_data_block(g * sb->s_inodes_per_group + byte*8 + bit);
+                    }
+                }
+            }
+        }
+    } else {
+        check_data_blocks_parallel(workers);
+    }
+    end_phase("bitmaps");
+}
 
-    // check free blocks and inodes count
-    int free_blocks_count = sb->s_blocks_count - count_block();
-    int free_inodes_count = sb->s_inodes_count - count_inode();
-    if(free_blocks_count != sb->s_free_blocks_count){
-        int Z = abs(free_blocks_count - sb->s_free_blocks_count);
-        sb->s_free_blocks_count = free_blocks_count;
-        printf("Fixed: superblock's free blocks counter was off by %d compared to the bitmap\n", Z);
+// check the consistency of block bitmap
+void check_data_block(int index) {
+    char type = 0;
+    struct ext2_inode this_inode = *get_inode(index + 1);
+    if ((this_inode.i_mode & EXT2_S_IFLNK) == EXT2_S_IFLNK) {
+        type = 'l';
+    } else if ((this_inode.i_mode & EXT2_S_IFREG) == EXT2_S_IFREG) {
+        type = 'f';
+    } else if ((this_inode.i_mode & EXT2_S_IFDIR) == EXT2_S_IFDIR) {
+        type = 'd';
+    }
+
+
+    // if file is dir, regular file or symlink
+    if(type != 0){
+        int fixed = 0;
+        struct block_iter it;
+        unsigned int logical, block;
+        int count;
+
+        // check whether the corresponding bit is set to one in bitmap for block in use,
+        // for the data blocks and the indirect blocks at every level
+        block_iter_init(&it, &this_inode, BLOCK_ITER_ALL);
+        while ((count = block_iter_next(&it, &logical, &block)) > 0) {
+            fixed += claim_blocks(block, count);
+        }
+
+        // update total fixes counter
+        if(fixed > 0){
+            counter+= fixed;
+            if (dry_run) {
+                print_finding("\"kind\": \"unmarked_blocks\", \"inode\": %d, \"count\": %d", index+1, fixed);
+            } else {
+                printf("Fixed: %d in-use data blocks not marked in data bitmap for inode: [%d]\n", fixed, index+1);
+            }
+        }
+        
+    } 
+}
+
+// count used block number in a group
+int count_block(int group){
+    unsigned char *block_bitmap = disk + block_size * get_group_desc(group)->bg_block_bitmap;
+    // the last group may not end on a byte boundary, count_bits masks the rest
+    return count_bits(block_bitmap, 0, blocks_in_group(group));
+}
+
+// count used inode number in a group
+int count_inode(int group){
+    unsigned char *inode_bitmap = disk + block_size * get_group_desc(group)->bg_inode_bitmap;
+    return count_bits(inode_bitmap, 0, sb->s_inodes_per_group);
+}
+
+// set the free counters of the group from the bitmap counts
+void fix_group_counters(int g, int used_blocks, int used_inodes) {
+    struct ext2_group_desc *gd = get_group_desc(g);
+    int group_free_blocks = blocks_in_group(g) - used_blocks;
+    int group_free_inodes = sb->s_inodes_per_group - used_inodes;
+
+    if(group_free_blocks != gd->bg_free_blocks_count){
+        int Z = abs(group_free_blocks - gd->bg_free_blocks_count);
+        if (dry_run) {
+            print_finding("\"kind\": \"group_free_blocks\", \"group\": %d, \"delta\": %d",
+                          g, group_free_blocks - gd->bg_free_blocks_count);
+        } else {
+            printf("Fixed: block group's free blocks counter was off by %d compared to the bitmap\n", Z);
+        }
+        gd->bg_free_blocks_count = group_free_blocks;
+        mark_changed(gd, sizeof(struct ext2_group_desc), CHANGE_METADATA);
         counter += Z;
     }
 
-    if(free_blocks_count != bd->bg_free_blocks_count){
-        int Z = abs(free_blocks_count - bd->bg_free_blocks_count);
-        bd->bg_free_blocks_count = free_blocks_count;
-        printf("Fixed: block group's free blocks counter was off by %d compared to the bitmap\n", Z);
+    if(group_free_inodes != gd->bg_free_inodes_count){
+        int Z = abs(group_free_inodes - gd->bg_free_inodes_count);
+        if (dry_run) {
+            print_finding("\"kind\": \"group_free_inodes\", \"group\": %d, \"delta\": %d",
+                          g, group_free_inodes - gd->bg_free_inodes_count);
+        } else {
+            printf("Fixed: block group's free inodes counter was off by %d compared to the bitmap\n", Z);
+        }
+        gd->bg_free_inodes_count = group_free_inodes;
+        mark_changed(gd, sizeof(struct ext2_group_desc), CHANGE_METADATA);
+        counter += Z;
+    }
+}
+
+// set the free counters of the super block from the groups'
+void fix_super_counters(int free_blocks_count, int free_inodes_count) {
+    if(free_blocks_count != sb->s_free_blocks_count){
+        int Z = abs(free_blocks_count - sb->s_free_blocks_count);
+        if (dry_run) {
+            print_finding("\"kind\": \"free_blocks\", \"delta\": %d",
+                          free_blocks_count - (int)sb->s_free_blocks_count);
+        } else {
+            printf("Fixed: superblock's free blocks counter was off by %d compared to the bitmap\n", Z);
+        }
+        sb->s_free_blocks_count = free_blocks_count;
+        mark_changed(sb, sizeof(struct ext2_super_block), CHANGE_METADATA);
         counter += Z;
     }
 
     if(free_inodes_count != sb->s_free_inodes_count){
         int Z = abs(free_inodes_count - sb->s_free_inodes_count);
+        if (dry_run) {
+            print_finding("\"kind\": \"free_inodes\", \"delta\": %d",
+                          free_inodes_count - (int)sb->s_free_inodes_count);
+        } else {
+            printf("Fixed: superblock's free inodes counter was off by %d compared to the bitmap\n", Z);
+        }
         sb->s_free_inodes_count = free_inodes_count;
-        printf("Fixed: superblock's free inodes counter was off by %d compared to the bitmap\n", Z);
+        mark_changed(sb, sizeof(struct ext2_super_block), CHANGE_METADATA);
         counter += Z;
     }
+}
 
-    if(free_inodes_count != bd->bg_free_inodes_count){
-        int Z = abs(free_inodes_count - bd->bg_free_inodes_count);
-        bd->bg_free_inodes_count = free_inodes_count;
-        printf("Fixed: block group's free inodes counter was off by %d compared to the bitmap\n", Z);
-        counter += Z;
+// print a finding, after a comma if it is not the first
+void print_finding(const char *format, ...) {
+    static int printed = 0;
+    va_list args;
+    va_start(args, format);
+    printf(printed ? ",\n    {" : "\n    {");
+    vprintf(format, args);
+    printf("}");
+    va_end(args);
+    printed = 1;
+}
+
+// note the milliseconds since the last phase ended
+void end_phase(const char *name) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (phase_count < MAX_PHASES) {
+        phases[phase_count].name = name;
+        phases[phase_count].ms = (now.tv_sec - phase_start.tv_sec) * 1000.0 +
+            (now.tv_nsec - phase_start.tv_nsec) / 1e6;
+        phase_count++;
     }
+    phase_start = now;
+}
 
-    
-    // check i_mode, i_node bitmap and i_dtime
-    check_directory(EXT2_ROOT_INO - 1);
 
+// Add a problem to those the worker found
+static void add_finding(struct worker *w, int kind, int inode, int count,
+                        struct ext2_dir_entry *entry, unsigned char file_type) {
+    if (w->finding_count == w->finding_capacity) {
+        w->finding_capacity = w->finding_capacity == 0 ? 64 : w->finding_capacity * 2;
+        w->findings = realloc(w->findings, sizeof(struct finding) * w->finding_capacity);
+        if (w->findings == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    struct finding *f = &w->findings[w->finding_count++];
+    f->kind = kind;
+    f->inode = inode;
+    f->count = count;
+    f->entry = entry;
+    f->file_type = file_type;
+}
 
-    // check consistency of block bitmap
-    for(int byte = 0; byte < sb->s_inodes_count / 8; byte++){
-        for (int bit = 0; bit < 8; bit++){
-            unsigned char in_use = inode_bitmap[byte] & (1 << bit);
-            if(in_use){
-                check_data_block(byte*8 + bit);
-            }
+// Add a directory to those the worker ran into
+static void add_directory(struct worker *w, unsigned int inode) {
+    if (w->directory_count == w->directory_capacity) {
+        w->directory_capacity = w->directory_capacity == 0 ? 64 : w->directory_capacity * 2;
+        w->directories = realloc(w->directories, sizeof(unsigned int) * w->directory_capacity);
+        if (w->directories == NULL) {
+            perror("realloc");
+            exit(1);
         }
     }
-    
-    // Summary of fixes
-    if(counter == 0){
-        printf("No file system inconsistencies detected!\n");
-    }else{
-        printf("%d file system inconsistencies repaired!\n", counter);
+    w->directories[w->directory_count++] = inode;
+}
+
+// run fn on the threads, giving each a contiguous share of the items
+void run_workers(struct worker *workers, int total, void *(*fn)(void*)) {
+    for (int t = 0; t < jobs; t++) {
+        workers[t].start = (long long)total * t / jobs;
+        workers[t].end = (long long)total * (t + 1) / jobs;
+        workers[t].finding_count = 0;
+        workers[t].directory_count = 0;
     }
-    
-    return 0;
+    // a single job runs right here
+    if (jobs == 1) {
+        fn(&workers[0]);
+        return;
+    }
+    for (int t = 0; t < jobs; t++) {
+        if (pthread_create(&workers[t].thread, NULL, fn, &workers[t]) != 0) {
+            perror("pthread_create");
+            exit(1);
+        }
+    }
+    for (int t = 0; t < jobs; t++) {
+        pthread_join(workers[t].thread, NULL);
+    }
+}
+
+// count the used blocks and inodes of the groups of the worker
+void *count_groups(void *arg) {
+    struct worker *w = arg;
+    for (int g = w->start; g < w->end; g++) {
+        w->used_blocks[g] = count_block(g);
+        w->used_inodes[g] = count_inode(g);
+    }
+    return NULL;
 }
 
+// check the entries of the directory blocks of the worker, only noting
+// what is wrong
+void *check_blocks(void *arg) {
+    struct worker *w = arg;
+    for (int i = w->start; i < w->end; i++) {
+        unsigned char *dir = disk + block_size * w->items[i];
+        int size = 0;
+        while (size < block_size) {
+            struct ext2_dir_entry *this_dir = (struct ext2_dir_entry*)(dir + size);
+            if (this_dir->rec_len == 0) {
+                break;
+            }
+            size += this_dir->rec_len;
+            if (this_dir->inode == 0 || this_dir->inode > sb->s_inodes_count) {
+                continue;
+            }
+            // every directory is swept once, so '.' and '..' are counted
+            // once each, for the directory itself and for its parent
+            if (links != NULL) {
+                __atomic_fetch_add(&links[this_dir->inode], 1, __ATOMIC_RELAXED);
+            }
+
+            char type = 0;
+            unsigned char file_type = 0;
+            struct ext2_inode *this_inode = get_inode(this_dir->inode);
+            if ((this_inode->i_mode & EXT2_S_IFLNK) == EXT2_S_IFLNK) {
+                type = 'l';
+                file_type = EXT2_FT_SYMLINK;
+            } else if ((this_inode->i_mode & EXT2_S_IFREG) == EXT2_S_IFREG) {
+                type = 'f';
+                file_type = EXT2_FT_REG_FILE;
+            } else if ((this_inode->i_mode & EXT2_S_IFDIR) == EXT2_S_IFDIR) {
+                type = 'd';
+                file_type = EXT2_FT_DIR;
+            }
+            if (type != 0 && (this_dir->file_type & EXT2_FT_SYMLINK) != file_type) {
+                add_finding(w, FIND_TYPE, this_dir->inode, 0, this_dir, file_type);
+            }
 
-// loop over the blocks used by a directory
-void check_directory(int index) {
-    struct ext2_inode inode = inodes[index];
-    for (int i = 0; i < 12; i++) {
-        if (inode.i_block[i] == 0) {
-            return;
+            if (type != 0) {
+                if (!inode_in_use(this_dir->inode)) {
+                    add_finding(w, FIND_INODE, this_dir->inode, 0, NULL, 0);
+                }
+                if (this_inode->i_dtime != 0) {
+                    add_finding(w, FIND_DTIME, this_dir->inode, 0, NULL, 0);
+                }
+                // '.', '..' and the other entries of directories already
+                // seen are dropped by check_directories
+                if (type == 'd') {
+                    add_directory(w, this_dir->inode);
+                }
+            }
         }
-        check_block(inode.i_block[i]);
     }
-    
-    // Single indirect block
-    if (inode.i_block[12] != 0) {
-        unsigned int *single_indirect_block = 
-        (unsigned int *)(disk + inode.i_block[12] * EXT2_BLOCK_SIZE);
-        for (int k = 0; k < 256; k++) {
-            if (single_indirect_block[k] == 0) {
-                return;
+    return NULL;
+}
+
+// report an inode in use just marked in the bitmap
+static void report_unmarked_inode(int inode) {
+    if (dry_run) {
+        print_finding("\"kind\": \"unmarked_inode\", \"inode\": %d", inode);
+    } else {
+        printf("Fixed: inode [%d] not marked as in-use\n", inode);
+    }
+}
+
+// fix what the workers found, one problem at a time in their order
+static void apply_findings(struct worker *workers) {
+    for (int t = 0; t < jobs; t++) {
+        for (int i = 0; i < workers[t].finding_count; i++) {
+            struct finding *f = &workers[t].findings[i];
+            if (f->kind == FIND_TYPE) {
+                if (dry_run) {
+                    print_finding("\"kind\": \"entry_type\", \"inode\": %d, \"found\": %d, \"expected\": %d",
+                                  f->inode, f->entry->file_type, f->file_type);
+                } else {
+                    printf("Fixed: Entry type vs inode mismatch: inode [%d]\n", f->inode);
+                }
+                f->entry->file_type = f->file_type;
+                mark_changed(f->entry, sizeof(struct ext2_dir_entry), CHANGE_METADATA);
+                counter++;
+            } else if (f->kind == FIND_INODE) {
+                // the same inode may be found by more than one thread
+                if (claim_inode(f->inode)) {
+                    counter++;
+                    report_unmarked_inode(f->inode);
+                }
+            } else if (f->kind == FIND_DTIME) {
+                struct ext2_inode *this_inode = get_inode(f->inode);
+                if (this_inode->i_dtime != 0) {
+                    this_inode->i_dtime = 0;
+                    mark_changed(this_inode, sizeof(struct ext2_inode), CHANGE_METADATA);
+                    counter++;
+                    if (dry_run) {
+                        print_finding("\"kind\": \"deleted_inode\", \"inode\": %d", f->inode);
+                    } else {
+                        printf("Fixed: valid inode marked for deletion: [%d]\n", f->inode);
+                    }
+                }
+            } else if (f->kind == FIND_BLOCKS && f->count > 0) {
+                counter += f->count;
+                if (dry_run) {
+                    print_finding("\"kind\": \"unmarked_blocks\", \"inode\": %d, \"count\": %d",
+                                  f->inode, f->count);
+                } else {
+                    printf("Fixed: %d in-use data blocks not marked in data bitmap for inode: [%d]\n",
+                           f->count, f->inode);
+                }
             }
-            check_block(single_indirect_block[k]);
         }
     }
 }
 
-// loop over the files in the block to check and check the consistency of
-// imode, inode bitmap and i_dtime
+static int compare_blocks(const void *a, const void *b) {
+    unsigned int x = *(const unsigned int*)a;
+    unsigned int y = *(const unsigned int*)b;
+    return x < y ? -1 : x > y;
+}
 
-void check_block(int block) {
-    
-    int size = 0; //record total rec_len of blocks accessed
-    unsigned char *dir = disk + EXT2_BLOCK_SIZE * block;
-    struct ext2_dir_entry *this_dir = (struct ext2_dir_entry*)dir;
-
-    while (size != EXT2_BLOCK_SIZE) {
-
-        // check consistency of file type
-        char type = 0;
-        int type_fixed = 0;
-        struct ext2_inode *this_inode = &inodes[this_dir->inode - 1];
-        if ((this_inode->i_mode & EXT2_S_IFLNK) == EXT2_S_IFLNK) {
-            type = 'l';
-            if ((this_dir->file_type & EXT2_FT_SYMLINK) != EXT2_FT_SYMLINK) {
-                this_dir->file_type = EXT2_FT_SYMLINK;
-                type_fixed = 1;
-            }
-        } else if ((this_inode->i_mode & EXT2_S_IFREG) == EXT2_S_IFREG) {
-            type = 'f';
-            if ((this_dir->file_type & EXT2_FT_SYMLINK) != EXT2_FT_REG_FILE) {
-                this_dir->file_type = EXT2_FT_REG_FILE;
-                type_fixed = 1;
-            }
-        } else if ((this_inode->i_mode & EXT2_S_IFDIR) == EXT2_S_IFDIR) {
-            type = 'd';
-            if ((this_dir->file_type & EXT2_FT_SYMLINK) != EXT2_FT_DIR) {
-                this_dir->file_type = EXT2_FT_DIR;
-                type_fixed = 1;
+// check the directories a level at a time, from the root
+void check_directories(struct worker *workers) {
+    // the directories already in a level, one bit per inode
+    unsigned char *visited = calloc(sb->s_inodes_count / 8 + 1, 1);
+    unsigned int *level = malloc(sizeof(unsigned int));
+    if (visited == NULL || level == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    int level_count = 1;
+    level[0] = EXT2_ROOT_INO;
+    visited[EXT2_ROOT_INO / 8] |= 1 << (EXT2_ROOT_INO % 8);
+
+    while (level_count > 0) {
+        // the blocks of the directories of this level, in disk order
+        int block_count = 0;
+        int block_capacity = 64;
+        unsigned int *blocks = malloc(sizeof(unsigned int) * block_capacity);
+        for (int d = 0; d < level_count; d++) {
+            struct block_iter it;
+            unsigned int logical, block;
+            int count;
+            block_iter_init(&it, get_inode(level[d]), BLOCK_ITER_DATA);
+            while ((count = block_iter_next(&it, &logical, &block)) > 0) {
+                for (int i = 0; i < count; i++) {
+                    if (block_count == block_capacity) {
+                        block_capacity *= 2;
+                        blocks = realloc(blocks, sizeof(unsigned int) * block_capacity);
+                        if (blocks == NULL) {
+                            perror("realloc");
+                            exit(1);
+                        }
+                    }
+                    blocks[block_count++] = block + i;
+                }
             }
         }
+        free(level);
+        qsort(blocks, block_count, sizeof(unsigned int), compare_blocks);
 
-        // update total fixes counter for file type fix
-        if(type_fixed == 1){
-            counter++;
-            printf("Fixed: Entry type vs inode mismatch: inode [%d]\n", this_dir->inode);
+        for (int t = 0; t < jobs; t++) {
+            workers[t].items = blocks;
         }
+        run_workers(workers, block_count, check_blocks);
+        free(blocks);
+        apply_findings(workers);
 
+        // the directories not seen yet make the next level
+        level_count = 0;
+        for (int t = 0; t < jobs; t++) {
+            level_count += workers[t].directory_count;
+        }
+        level = malloc(sizeof(unsigned int) * (level_count > 0 ? level_count : 1));
+        level_count = 0;
+        for (int t = 0; t < jobs; t++) {
+            for (int d = 0; d < workers[t].directory_count; d++) {
+                unsigned int inode = workers[t].directories[d];
+                if (inode > sb->s_inodes_count || (visited[inode / 8] & (1 << (inode % 8)))) {
+                    continue;
+                }
+                visited[inode / 8] |= 1 << (inode % 8);
+                level[level_count++] = inode;
+            }
+        }
+    }
+    free(level);
+    free(visited);
+}
+
+// check the link counts against the entries counted, group by group
+void check_link_counts() {
+    int inode_size = sb->s_rev_level == 0 ? 128 : sb->s_inode_size;
+    unsigned int first_inode = sb->s_rev_level == 0 ? EXT2_GOOD_OLD_FIRST_INO : sb->s_first_ino;
+
+    for (int g = 0; g < get_group_count(); g++) {
+        struct ext2_group_desc *gd = get_group_desc(g);
+        unsigned char *table = disk + block_size * gd->bg_inode_table;
+        unsigned char *inode_bitmap = disk + block_size * gd->bg_inode_bitmap;
+        for (int i = 0; i < sb->s_inodes_per_group; i++) {
+            unsigned int inode = g * sb->s_inodes_per_group + i + 1;
+            // the reserved inodes other than the root have no entries
+            if (inode < first_inode && inode != EXT2_ROOT_INO) {
+                continue;
+            }
+            struct ext2_inode *this_inode = (struct ext2_inode*)(table + inode_size * i);
+            if ((this_inode->i_mode & EXT2_S_IFLNK) != EXT2_S_IFLNK &&
+                (this_inode->i_mode & EXT2_S_IFREG) != EXT2_S_IFREG &&
+                (this_inode->i_mode & EXT2_S_IFDIR) != EXT2_S_IFDIR) {
+                continue;
+            }
 
-        // if is regular file, directory or symlink
-        if(type != 0){
-           
-            // check whether inode is marked as in user in inode bitmap
-            int byte = (this_dir->inode - 1)/8; 
-            int bit = (this_dir->inode - 1) % 8;
-            if( (inode_bitmap[byte] & (1 << bit)) == 0){
-                *(inode_bitmap + byte) |= 1 << bit;
-                sb->s_free_inodes_count--;
-                bd->bg_free_inodes_count--;
+            if (links[inode] == 0) {
+                // in use but out of reach: released as ext2_rm would, so
+                // that ext2_restore can still bring back its blocks
+                if (!(inode_bitmap[i / 8] & (1 << (i % 8)))) {
+                    continue;
+                }
+                if (dry_run) {
+                    print_finding("\"kind\": \"orphan_inode\", \"inode\": %u", inode);
+                } else {
+                    printf("Fixed: inode [%u] in use but not in any directory\n", inode);
+                }
+                if ((this_inode->i_mode & EXT2_S_IFDIR) == EXT2_S_IFDIR) {
+                    gd->bg_used_dirs_count--;
+                    mark_changed(gd, sizeof(struct ext2_group_desc), CHANGE_METADATA);
+                }
+                this_inode->i_links_count = 0;
+                this_inode->i_dtime = time(NULL);
+                mark_changed(this_inode, sizeof(struct ext2_inode), CHANGE_METADATA);
+                release_inode(inode);
+                release_inode_blocks(this_inode);
+                counter++;
+            } else if (this_inode->i_links_count != links[inode]) {
+                if (dry_run) {
+                    print_finding("\"kind\": \"link_count\", \"inode\": %u, \"found\": %d, \"expected\": %d",
+                                  inode, this_inode->i_links_count, links[inode]);
+                } else {
+                    printf("Fixed: link count of inode [%u] was %d instead of %d\n",
+                           inode, this_inode->i_links_count, links[inode]);
+                }
+                this_inode->i_links_count = links[inode];
+                mark_changed(this_inode, sizeof(struct ext2_inode), CHANGE_METADATA);
                 counter++;
-                printf("Fixed: inode [%d] not marked as in-use\n", this_dir->inode);
             }
+        }
+    }
+}
 
+// check the blocks of the inodes in use of the worker, noting in its shadow
+// bitmap the blocks they use and the inodes with blocks missing from the
+// block bitmap; another thread may find the same block missing too
+void *check_inode_blocks(void *arg) {
+    struct worker *w = arg;
+    for (int index = w->start; index < w->end; index++) {
+        if (!inode_in_use(index + 1)) {
+            continue;
+        }
+        struct ext2_inode *this_inode = get_inode(index + 1);
+        if ((this_inode->i_mode & EXT2_S_IFLNK) != EXT2_S_IFLNK &&
+            (this_inode->i_mode & EXT2_S_IFREG) != EXT2_S_IFREG &&
+            (this_inode->i_mode & EXT2_S_IFDIR) != EXT2_S_IFDIR) {
+            continue;
+        }
 
-            // check deletion time
-            if(this_inode->i_dtime != 0){
-                this_inode->i_dtime = 0;
-                counter++;
-                printf("Fixed: valid inode marked for deletion: [%d]\n", this_dir->inode);
+        int missing = 0;
+        struct block_iter it;
+        unsigned int logical, block;
+        int count;
+        block_iter_init(&it, this_inode, BLOCK_ITER_ALL);
+        while ((count = block_iter_next(&it, &logical, &block)) > 0) {
+            for (int i = 0; i < count; i++) {
+                unsigned int bit = block + i - sb->s_first_data_block;
+                // a block seen before by this thread was counted then
+                if (w->shadow[bit / 8] & (1 << (bit % 8))) {
+                    continue;
+                }
+                w->shadow[bit / 8] |= 1 << (bit % 8);
+                if (!block_in_use(block + i)) {
+                    missing++;
+                }
             }
+        }
+        if (missing > 0) {
+            add_finding(w, FIND_BLOCKS, index + 1, missing, NULL, 0);
+        }
+    }
+    return NULL;
+}
 
-            // check subdirectory
-            // avoid checking current and parent dir and lost-and-found to avoid infinite loop and seg fault
-            if(type == 'd' && this_dir->name[0]!='.' && this_dir->inode != 11){ 
-                check_directory(this_dir->inode - 1);
+// check the blocks of every inode, then mark the missing ones at once
+void check_data_blocks_parallel(struct worker *workers) {
+    size_t shadow_size = (sb->s_blocks_count - sb->s_first_data_block + 7) / 8;
+    for (int t = 0; t < jobs; t++) {
+        workers[t].shadow = calloc(shadow_size, 1);
+        if (workers[t].shadow == NULL) {
+            perror("calloc");
+            exit(1);
+        }
+    }
+    run_workers(workers, sb->s_inodes_count, check_inode_blocks);
+
+    // merge the shadow bitmaps into the first one
+    unsigned char *shadow = workers[0].shadow;
+    for (int t = 1; t < jobs; t++) {
+        for (size_t i = 0; i < shadow_size; i++) {
+            shadow[i] |= workers[t].shadow[i];
+        }
+        free(workers[t].shadow);
+    }
+
+    // keep only the blocks in use that the bitmap is missing
+    unsigned int blocks = sb->s_blocks_count - sb->s_first_data_block;
+    for (unsigned int bit = 0; bit < blocks; bit++) {
+        if ((shadow[bit / 8] & (1 << (bit % 8))) && block_in_use(bit + sb->s_first_data_block)) {
+            shadow[bit / 8] &= ~(1 << (bit % 8));
+        }
+    }
+
+    // mark each of them once, counted for the first inode using it in
+    // inode order, as the serial check does, then report them
+    for (int t = 0; t < jobs; t++) {
+        for (int i = 0; i < workers[t].finding_count; i++) {
+            struct finding *f = &workers[t].findings[i];
+            if (f->kind != FIND_BLOCKS) {
+                continue;
+            }
+            f->count = 0;
+            struct block_iter it;
+            unsigned int logical, block;
+            int count;
+            block_iter_init(&it, get_inode(f->inode), BLOCK_ITER_ALL);
+            while ((count = block_iter_next(&it, &logical, &block)) > 0) {
+                for (int j = 0; j < count; j++) {
+                    unsigned int bit = block + j - sb->s_first_data_block;
+                    if (shadow[bit / 8] & (1 << (bit % 8))) {
+                        shadow[bit / 8] &= ~(1 << (bit % 8));
+                        f->count += claim_blocks(block + j, 1);
+                    }
+                }
             }
         }
-        
-        // go to the next file in this directory
-        size += this_dir->rec_len;
-        dir += this_dir->rec_len;
-        this_dir = (struct ext2_dir_entry*)dir;
     }
-    
+    free(shadow);
+    apply_findings(workers);
 }
 
 
-// check the consistency of block bitmap
-void check_data_block(int index) {
-    char type = 0;
-    struct ext2_inode this_inode = inodes[index];
-    if ((this_inode.i_mode & EXT2_S_IFLNK) == EXT2_S_IFLNK) {
-        type = 'l';
-    } else if ((this_inode.i_mode & EXT2_S_IFREG) == EXT2_S_IFREG) {
-        type = 'f';
-    } else if ((this_inode.i_mode & EXT2_S_IFDIR) == EXT2_S_IFDIR) {
-        type = 'd';
+// Reference bitmaps of check_bitmaps_shadow: each group takes a whole
+// number of 64-bit words, so a group lines up with the words of its bitmap
+static uint64_t *block_refs;
+static uint64_t *block_dups;
+static uint64_t *inode_refs;
+static int block_stride;
+static int inode_stride;
+
+// Whether the group holds a copy of the super block and the descriptors
+static int group_has_super(int group) {
+    if (group <= 1 || !(sb->s_feature_ro_compat & EXT2_FEATURE_RO_COMPAT_SPARSE_SUPER)) {
+        return 1;
+    }
+    for (int base = 3; base <= 7; base += 2) {
+        int n = group;
+        while (n % base == 0) {
+            n /= base;
+        }
+        if (n == 1) {
+            return 1;
+        }
     }
+    return 0;
+}
+
+// Note a reference to the block, and whether it had one already
+static void reference_block(unsigned int block) {
+    if (block < sb->s_first_data_block || block >= sb->s_blocks_count) {
+        return;
+    }
+    unsigned int index = block - sb->s_first_data_block;
+    unsigned int group = index / sb->s_blocks_per_group;
+    unsigned int bit = index % sb->s_blocks_per_group;
+    uint64_t *word = &block_refs[group * block_stride + bit / 64];
+    uint64_t mask = 1ULL << (bit % 64);
+    if (*word & mask) {
+        block_dups[group * block_stride + bit / 64] |= mask;
+    }
+    *word |= mask;
+}
 
+// Note the references of the inode table, group by group
+static void scan_inode_table() {
+    int group_count = get_group_count();
+    int inode_size = sb->s_rev_level == 0 ? 128 : sb->s_inode_size;
+    unsigned int first_inode = sb->s_rev_level == 0 ? EXT2_GOOD_OLD_FIRST_INO : sb->s_first_ino;
+    int descriptor_blocks = (group_count * sizeof(struct ext2_group_desc) + block_size - 1)
+        / block_size;
+    int table_blocks = (sb->s_inodes_per_group * inode_size + block_size - 1) / block_size;
 
-    // if file is dir, regular file or symlink
-    if(type != 0){
-        int fixed = 0;
+    for (int g = 0; g < group_count; g++) {
+        struct ext2_group_desc *gd = get_group_desc(g);
 
-        // check whether the corresponding bit is set to one in bitmap for block in use 
-        for (int k = 0; k < 12; k++) {
-            if (this_inode.i_block[k] == 0) {
-                break;
+        // the blocks of the file system itself; the blocks reserved for
+        // more descriptors belong to the resize inode
+        if (group_has_super(g)) {
+            unsigned int start = group_first_block(g);
+            int count = 1 + descriptor_blocks;
+            for (int i = 0; i < count; i++) {
+                reference_block(start + i);
+            }
+        }
+        reference_block(gd->bg_block_bitmap);
+        reference_block(gd->bg_inode_bitmap);
+        for (int i = 0; i < table_blocks; i++) {
+            reference_block(gd->bg_inode_table + i);
+        }
+
+        // then the inodes in the order of the table; the reserved inodes
+        // are in use for as long as they are set up
+        unsigned char *table = disk + block_size * gd->bg_inode_table;
+        for (unsigned int i = 0; i < sb->s_inodes_per_group; i++) {
+            struct ext2_inode *this_inode = (struct ext2_inode*)(table + inode_size * i);
+            unsigned int inode = g * sb->s_inodes_per_group + i + 1;
+            unsigned short type = this_inode->i_mode & 0xF000;
+            // (ext2_rm only sets i_dtime once the last link is gone; a link
+            // count with i_dtime set is fixed by the directory check); any
+            // type counts, FIFOs, sockets and devices made elsewhere too
+            int in_use;
+            if (inode < first_inode) {
+                in_use = 1;
             } else {
-                int block = this_inode.i_block[k] - 1;
-                if(!( block_bitmap[block / 8] & (1 << (block % 8)) )){
-                    block_bitmap[block/8] |= 1 << (block % 8);
-                    sb->s_free_blocks_count--;
-                    bd->bg_free_blocks_count--;
-                    fixed++;
+                in_use = this_inode->i_links_count > 0 && this_inode->i_mode != 0;
+            }
+            if (!in_use) {
+                continue;
+            }
+            inode_refs[g * inode_stride + i / 64] |= 1ULL << (i % 64);
+
+            // only these types have a block map: a device keeps its number
+            // in i_block, and a symbolic link without blocks its target
+            if (type != EXT2_S_IFREG && type != EXT2_S_IFDIR && type != EXT2_S_IFLNK) {
+                continue;
+            }
+            if (this_inode->i_blocks == 0) {
+                continue;
+            }
+            struct block_iter it;
+            unsigned int logical, block;
+            int count;
+            block_iter_init(&it, this_inode, BLOCK_ITER_ALL);
+            while ((count = block_iter_next(&it, &logical, &block)) > 0) {
+                for (int k = 0; k < count; k++) {
+                    reference_block(block + k);
                 }
             }
         }
+    }
+}
 
-        // check for single indirect block
-        if (this_inode.i_block[12] != 0) {
-            unsigned int *single_indirect_block = 
-            (unsigned int *)(disk + this_inode.i_block[12] * EXT2_BLOCK_SIZE);
-            for (int k = 0; k < 256; k++) {
-                if (single_indirect_block[k] == 0) {
-                    break;
+/**
+ * Compare the reference bitmap of a group with its bitmap in the image, of
+ * nbits bits, 64 at a time. Each word that differs goes to fix, with the
+ * group, the index of the word, the referenced bits that are not set and
+ * the set bits that are not referenced.
+ */
+static void compare_group(uint64_t *refs, uint64_t *bitmap, int nbits, int group,
+                          void (*fix)(int, int, uint64_t, uint64_t)) {
+    int nwords = (nbits + 63) / 64;
+    for (int w = 0; w < nwords; w++) {
+        // the bits past the end of the group are not compared
+        uint64_t mask = ~0ULL;
+        if (w == nwords - 1 && nbits % 64 != 0) {
+            mask = (1ULL << (nbits % 64)) - 1;
+        }
+        uint64_t diff = (refs[w] ^ bitmap[w]) & mask;
+        if (diff != 0) {
+            fix(group, w, diff & refs[w], diff & bitmap[w]);
+        }
+    }
+}
+
+static int missing_blocks = 0;
+static int leaked_blocks = 0;
+
+// mark the missing blocks of a word as in use, and free the leaked ones
+static void fix_block_word(int group, int w, uint64_t missing, uint64_t leaked) {
+    unsigned int first = group_first_block(group) + w * 64;
+    for (; missing != 0; missing &= missing - 1) {
+        claim_block(first + __builtin_ctzll(missing));
+        missing_blocks++;
+    }
+    for (; leaked != 0; leaked &= leaked - 1) {
+        release_block(first + __builtin_ctzll(leaked));
+        leaked_blocks++;
+    }
+}
+
+// mark the missing inodes of a word as in use, and free the leaked ones
+static void fix_inode_word(int group, int w, uint64_t missing, uint64_t leaked) {
+    unsigned int first = group * sb->s_inodes_per_group + w * 64 + 1;
+    for (; missing != 0; missing &= missing - 1) {
+        int inode = first + __builtin_ctzll(missing);
+        claim_inode(inode);
+        counter++;
+        report_unmarked_inode(inode);
+    }
+    for (; leaked != 0; leaked &= leaked - 1) {
+        int inode = first + __builtin_ctzll(leaked);
+        release_inode(inode);
+        counter++;
+        if (dry_run) {
+            print_finding("\"kind\": \"unused_inode\", \"inode\": %d", inode);
+        } else {
+            printf("Fixed: unused inode [%d] marked as in-use\n", inode);
+        }
+    }
+}
+
+// check both bitmaps against what the inode table references
+void check_bitmaps_shadow() {
+    int group_count = get_group_count();
+    block_stride = (sb->s_blocks_per_group + 63) / 64;
+    inode_stride = (sb->s_inodes_per_group + 63) / 64;
+    block_refs = calloc((size_t)group_count * block_stride, sizeof(uint64_t));
+    block_dups = calloc((size_t)group_count * block_stride, sizeof(uint64_t));
+    inode_refs = calloc((size_t)group_count * inode_stride, sizeof(uint64_t));
+    if (block_refs == NULL || block_dups == NULL || inode_refs == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+
+    scan_inode_table();
+
+    // the bitmap blocks are read 64 bits at a time, they start on a block
+    for (int g = 0; g < group_count; g++) {
+        struct ext2_group_desc *gd = get_group_desc(g);
+        compare_group(block_refs + g * block_stride,
+                      (uint64_t*)(disk + block_size * gd->bg_block_bitmap),
+                      blocks_in_group(g), g, fix_block_word);
+        compare_group(inode_refs + g * inode_stride,
+                      (uint64_t*)(disk + block_size * gd->bg_inode_bitmap),
+                      sb->s_inodes_per_group, g, fix_inode_word);
+    }
+    if (missing_blocks > 0) {
+        counter += missing_blocks;
+        if (dry_run) {
+            print_finding("\"kind\": \"unmarked_blocks\", \"count\": %d", missing_blocks);
+        } else {
+            printf("Fixed: %d in-use data blocks not marked in data bitmap\n", missing_blocks);
+        }
+    }
+    if (leaked_blocks > 0) {
+        counter += leaked_blocks;
+        if (dry_run) {
+            print_finding("\"kind\": \"unused_blocks\", \"count\": %d", leaked_blocks);
+        } else {
+            printf("Fixed: %d unused data blocks marked in data bitmap\n", leaked_blocks);
+        }
+    }
+
+    // blocks used twice cannot be fixed here, only reported
+    for (int g = 0; g < group_count; g++) {
+        for (int w = 0; w < block_stride; w++) {
+            uint64_t dups = block_dups[g * block_stride + w];
+            for (; dups != 0; dups &= dups - 1) {
+                unsigned int block = group_first_block(g) + w * 64 + __builtin_ctzll(dups);
+                if (dry_run) {
+                    print_finding("\"kind\": \"duplicate_block\", \"block\": %u", block);
                 } else {
-                   int block = single_indirect_block[k] - 1;
-                    if(!( block_bitmap[block / 8] & (1 << (block % 8)) )){
-                        block_bitmap[block/8] |= 1 << (block % 8);
-                        sb->s_free_blocks_count--;
-                        bd->bg_free_blocks_count--;
-                        fixed++;
-                    }
+                    printf("Found: block [%u] is used more than once\n", block);
                 }
             }
         }
+    }
+    free(block_refs);
+    free(block_dups);
+    free(inode_refs);
+}
 
-        // update total fixes counter
-        if(fixed > 0){
-            counter+= fixed;
-            printf("Fixed: %d in-use data blocks not marked in data bitmap for inode: [%d]\n", fixed, index+1);
+// order block runs by their first block
+static int compare_runs(const void *a, const void *b) {
+    unsigned int x = ((const struct block_run*)a)->start;
+    unsigned int y = ((const struct block_run*)b)->start;
+    return x < y ? -1 : x > y;
+}
+
+// whether one of the runs, sorted and not overlapping, holds the block
+static int find_run(struct block_run *runs, int run_count, unsigned int block) {
+    int low = 0;
+    int high = run_count - 1;
+    while (low <= high) {
+        int middle = (low + high) / 2;
+        if (block < runs[middle].start) {
+            high = middle - 1;
+        } else if (block >= runs[middle].start + runs[middle].count) {
+            low = middle + 1;
+        } else {
+            return 1;
         }
-        
-    } 
+    }
+    return 0;
 }
 
-// count used block number
-int count_block(){
-    int block_counter = 0;   
-    for(int byte = 0; byte < sb->s_blocks_count / 8; byte++){
-        for (int bit = 0; bit < 8; bit++){
-            unsigned char in_use = block_bitmap[byte] & (1 << bit);
-            if(in_use){
-                block_counter++;
+// check what the records of the dirty log name, a phase at a time
+int check_incremental(struct worker *workers) {
+    struct dirty_record *records;
+    int record_count = read_dirty_log(&records);
+    int group_count = get_group_count();
+
+    // the inodes and directories named, and the groups of what is named
+    unsigned char *dirty_inodes = calloc(sb->s_inodes_count / 8 + 1, 1);
+    unsigned char *dirty_groups = calloc(group_count / 8 + 1, 1);
+    unsigned int *directories = malloc(sizeof(unsigned int) * (record_count + 1));
+    int directory_count = 0;
+    if (dirty_inodes == NULL || dirty_groups == NULL || directories == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    for (int r = 0; r < record_count; r++) {
+        struct dirty_record *record = &records[r];
+        if (record->kind == DIRTY_BLOCKS) {
+            for (unsigned int b = record->number; b < record->number + record->count;
+                 b += sb->s_blocks_per_group) {
+                if (b >= sb->s_first_data_block && b < sb->s_blocks_count) {
+                    dirty_groups[block_group(b) / 8] |= 1 << (block_group(b) % 8);
+                }
+            }
+            unsigned int last = record->number + record->count - 1;
+            if (last >= sb->s_first_data_block && last < sb->s_blocks_count) {
+                dirty_groups[block_group(last) / 8] |= 1 << (block_group(last) % 8);
             }
+            continue;
+        }
+        unsigned int inode = record->number;
+        if (inode < 1 || inode > sb->s_inodes_count) {
+            continue;
+        }
+        dirty_groups[inode_group(inode) / 8] |= 1 << (inode_group(inode) % 8);
+        if (dirty_inodes[inode / 8] & (1 << (inode % 8))) {
+            continue;
+        }
+        dirty_inodes[inode / 8] |= 1 << (inode % 8);
+        // a new directory has entries of its own, '.' and '..'
+        if (inode_in_use(inode) &&
+            (get_inode(inode)->i_mode & 0xF000) == EXT2_S_IFDIR) {
+            directories[directory_count++] = inode;
         }
     }
-    return block_counter;
-}
 
-// count used inode number
-int count_inode(){
-    int inode_counter = 0;
-    for(int byte = 0; byte < sb->s_inodes_count / 8; byte++){
-        for (int bit = 0; bit < 8; bit++){
-            unsigned char in_use = inode_bitmap[byte] & (1 << bit);
-            if(in_use){
-                inode_counter++;
+    // the counters of the groups named, then the super block's from the
+    // group descriptors
+    int free_blocks_count = 0;
+    int free_inodes_count = 0;
+    for (int g = 0; g < group_count; g++) {
+        if (dirty_groups[g / 8] & (1 << (g % 8))) {
+            fix_group_counters(g, count_block(g), count_inode(g));
+        }
+        free_blocks_count += get_group_desc(g)->bg_free_blocks_count;
+        free_inodes_count += get_group_desc(g)->bg_free_inodes_count;
+    }
+    fix_super_counters(free_blocks_count, free_inodes_count);
+    end_phase("counters");
+
+    // the entries of the directories named, without going down into the
+    // directories they hold
+    int block_count = 0;
+    int block_capacity = 64;
+    unsigned int *blocks = malloc(sizeof(unsigned int) * block_capacity);
+    for (int d = 0; d < directory_count; d++) {
+        struct block_iter it;
+        unsigned int logical, block;
+        int count;
+        block_iter_init(&it, get_inode(directories[d]), BLOCK_ITER_DATA);
+        while ((count = block_iter_next(&it, &logical, &block)) > 0) {
+            for (int i = 0; i < count; i++) {
+                if (block_count == block_capacity) {
+                    block_capacity *= 2;
+                    blocks = realloc(blocks, sizeof(unsigned int) * block_capacity);
+                    if (blocks == NULL) {
+                        perror("realloc");
+                        exit(1);
+                    }
+                }
+                blocks[block_count++] = block + i;
             }
         }
     }
-    
-    return inode_counter;
-}
\ No newline at end of file
+    qsort(blocks, block_count, sizeof(unsigned int), compare_blocks);
+    for (int t = 0; t < jobs; t++) {
+        workers[t].items = blocks;
+    }
+    run_workers(workers, block_count, check_blocks);
+    free(blocks);
+    apply_findings(workers);
+    end_phase("directories");
+
+    // the blocks of the inodes named must be marked in use, and these are
+    // the only ones the blocks named may belong to
+    int run_count = 0;
+    int run_capacity = 64;
+    struct block_run *runs = malloc(sizeof(struct block_run) * run_capacity);
+    for (unsigned int inode = 1; inode <= sb->s_inodes_count; inode++) {
+        if (!(dirty_inodes[inode / 8] & (1 << (inode % 8))) || !inode_in_use(inode)) {
+            continue;
+        }
+        check_data_block(inode - 1);
+        struct ext2_inode *this_inode = get_inode(inode);
+        if ((this_inode->i_mode & EXT2_S_IFLNK) != EXT2_S_IFLNK &&
+            (this_inode->i_mode & EXT2_S_IFREG) != EXT2_S_IFREG &&
+            (this_inode->i_mode & EXT2_S_IFDIR) != EXT2_S_IFDIR) {
+            continue;
+        }
+        struct block_iter it;
+        unsigned int logical, block;
+        int count;
+        block_iter_init(&it, this_inode, BLOCK_ITER_ALL);
+        while ((count = block_iter_next(&it, &logical, &block)) > 0) {
+            if (run_count == run_capacity) {
+                run_capacity *= 2;
+                runs = realloc(runs, sizeof(struct block_run) * run_capacity);
+                if (runs == NULL) {
+                    perror("realloc");
+                    exit(1);
+                }
+            }
+            runs[run_count].start = block;
+            runs[run_count].count = count;
+            run_count++;
+        }
+    }
+    qsort(runs, run_count, sizeof(struct block_run), compare_runs);
+
+    // a block no inode named owns may still belong to one the log missed,
+    // so it is only reported, for a full check with --shadow to settle
+    int unowned = 0;
+    for (int r = 0; r < record_count; r++) {
+        if (records[r].kind != DIRTY_BLOCKS) {
+            continue;
+        }
+        for (int i = 0; i < records[r].count; i++) {
+            unsigned int block = records[r].number + i;
+            if (block < sb->s_first_data_block || block >= sb->s_blocks_count ||
+                !block_in_use(block) || find_run(runs, run_count, block)) {
+                continue;
+            }
+            if (dry_run) {
+                print_finding("\"kind\": \"unowned_block\", \"block\": %u", block);
+            } else {
+                printf("Found: block [%u] is in use but not owned by a logged inode\n", block);
+            }
+            unowned++;
+        }
+    }
+    end_phase("bitmaps");
+
+    free(runs);
+    free(directories);
+    free(dirty_groups);
+    free(dirty_inodes);
+    free(records);
+    return unowned;
+}
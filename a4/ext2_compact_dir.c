@@ -0,0 +1,42 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include "path.h"
+#include "ops.h"
+#include "ext2.h"
+
+
+unsigned char *disk;
+
+int main(int argc, char** argv) {
+
+    int opt;
+    int order = COMPACT_KEEP_ORDER;
+    int bad_option = 0;
+
+    // sort the entries by name or by hash, or keep their order
+    while ((opt = getopt(argc, argv, "s:")) != -1){
+        if (opt == 's' && strcmp(optarg, "name") == 0) {
+            order = COMPACT_BY_NAME;
+        } else if (opt == 's' && strcmp(optarg, "hash") == 0) {
+            order = COMPACT_BY_HASH;
+        } else {
+            bad_option = 1;
+        }
+    }
+
+    if(bad_option || argc - optind != 2) {
+        fprintf(stderr, "Usage: ext2_compact_dir <image file name> (-s name|hash) <path to directory>\n");
+        exit(1);
+    }
+
+
+    // open disk image; getopt has moved -s in front of the other arguments
+    int fd = open_image(argv[optind], IMAGE_RANDOM);
+
+    int result = op_compact_dir(argv[optind + 1], order);
+    sync_changes();
+    close(fd);
+    return result;
+}
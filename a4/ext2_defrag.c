@@ -0,0 +1,87 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include "path.h"
+#include "ext2.h"
+
+
+unsigned char *disk;
+
+int main(int argc, char** argv) {
+
+    int opt;
+    int dry_run = 0;
+
+    // only report the fragmented files
+    while ((opt = getopt(argc, argv, "n")) != -1){
+        if (opt == 'n') {
+            dry_run = 1;
+        } else {
+            dry_run = -1;
+        }
+    }
+
+    if(dry_run == -1 || argc - optind != 1) {
+        fprintf(stderr, "Usage: ext2_defrag (-n) <image file name>\n");
+        exit(1);
+    }
+
+    // open disk image, for a scan of the whole inode table; only a private
+    // copy of it for a report
+    int fd = open_image(argv[optind],
+                        dry_run ? IMAGE_SEQUENTIAL | IMAGE_PRIVATE : IMAGE_SEQUENTIAL);
+
+    struct ext2_super_block *sb = get_super_block();
+    unsigned int first_inode = sb->s_rev_level == 0 ? EXT2_GOOD_OLD_FIRST_INO : sb->s_first_ino;
+    int fragmented = 0;
+    int moved = 0;
+    int moved_blocks = 0;
+
+    // the root and the files of the users; the other reserved inodes are
+    // left where mke2fs put them
+    for (unsigned int inode = EXT2_ROOT_INO; inode <= sb->s_inodes_count; inode++) {
+        if ((inode != EXT2_ROOT_INO && inode < first_inode) || !inode_in_use(inode)) {
+            continue;
+        }
+        struct ext2_inode *this_inode = get_inode(inode);
+        unsigned short type = this_inode->i_mode & 0xF000;
+        // a symbolic link without blocks holds its target in i_block
+        if ((type != EXT2_S_IFREG && type != EXT2_S_IFDIR && type != EXT2_S_IFLNK) ||
+            this_inode->i_blocks == 0) {
+            continue;
+        }
+
+        int fragments = count_fragments(this_inode);
+        if (fragments <= 1) {
+            continue;
+        }
+        fragmented++;
+        if (dry_run) {
+            printf("inode [%u]: %d fragments\n", inode, fragments);
+            continue;
+        }
+
+        // the blocks moved are logged, the inode they will belong to too
+        log_dirty(DIRTY_INODE, inode, 1);
+        // close to the inode, like a new file
+        if (relocate_inode_blocks(this_inode, group_first_block(inode_group(inode))) ==
+            ERR_NO_BLOCK) {
+            printf("inode [%u]: %d fragments, no free run long enough\n", inode, fragments);
+            continue;
+        }
+        moved++;
+        moved_blocks += this_inode->i_blocks / (block_size / 512);
+    }
+
+    if (dry_run) {
+        printf("%d fragmented files\n", fragmented);
+    } else {
+        printf("%d of %d fragmented files defragmented, %d blocks moved\n",
+               moved, fragmented, moved_blocks);
+    }
+
+    // write back the bitmaps and counters of the last files
+    sync_changes();
+    close(fd);
+    return 0;
+}
@@ -0,0 +1,65 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include "path.h"
+#include "ext2.h"
+
+
+unsigned char *disk;
+
+int main(int argc, char** argv) {
+
+    int opt;
+    int per_group = 0;
+    int bad_option = 0;
+
+    // also show the counts of every group
+    while ((opt = getopt(argc, argv, "g")) != -1){
+        if (opt == 'g') {
+            per_group = 1;
+        } else {
+            bad_option = 1;
+        }
+    }
+
+    if(bad_option || argc - optind != 1) {
+        fprintf(stderr, "Usage: ext2_df (-g) <image file name>\n");
+        exit(1);
+    }
+
+    // open disk image, read-only; only the bitmaps are read, one after the
+    // other, so the counters of the image need not be right
+    int fd = open_image(argv[optind], IMAGE_SEQUENTIAL | IMAGE_PRIVATE);
+    struct ext2_super_block *sb = get_super_block();
+    int group_count = get_group_count();
+
+    long long total_blocks = 0, used_blocks = 0;
+    long long total_inodes = 0, used_inodes = 0;
+    for (int g = 0; g < group_count; g++) {
+        struct ext2_group_desc *gd = get_group_desc(g);
+        int blocks = blocks_in_group(g);
+        int blocks_used = count_bits(disk + block_size * gd->bg_block_bitmap, 0, blocks);
+        int inodes_used = count_bits(disk + block_size * gd->bg_inode_bitmap, 0,
+                                     sb->s_inodes_per_group);
+        total_blocks += blocks;
+        used_blocks += blocks_used;
+        total_inodes += sb->s_inodes_per_group;
+        used_inodes += inodes_used;
+        if (per_group) {
+            printf("group %d: blocks %d used, %d free; inodes %d used, %d free\n", g,
+                   blocks_used, blocks - blocks_used,
+                   inodes_used, sb->s_inodes_per_group - inodes_used);
+        }
+    }
+
+    printf("%-8s %12s %12s %12s %5s\n", "", "total", "used", "free", "use%");
+    printf("%-8s %12lld %12lld %12lld %4lld%%\n", "blocks", total_blocks, used_blocks,
+           total_blocks - used_blocks, total_blocks > 0 ? used_blocks * 100 / total_blocks : 0);
+    printf("%-8s %12lld %12lld %12lld %4lld%%\n", "inodes", total_inodes, used_inodes,
+           total_inodes - used_inodes, total_inodes > 0 ? used_inodes * 100 / total_inodes : 0);
+    printf("%lld KiB free of %lld KiB\n", (total_blocks - used_blocks) * (long long)block_size / 1024,
+           total_blocks * (long long)block_size / 1024);
+
+    close(fd);
+    return 0;
+}
@@ -0,0 +1,643 @@
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include "path.h"
+#include "htree.h"
+#include "ext2.h"
+
+// The dx_root_info of the root block comes right after "." and ".."
+#define DX_ROOT_INFO_OFFSET 24
+// The dx_entry of a node block come right after its empty entry
+#define DX_NODE_ENTRIES_OFFSET 8
+
+// Largest hash, reserved by the kernel to mark the end of a directory
+#define DX_HASH_EOF (0x7fffffffU << 1)
+
+
+/*
+ * The hash functions, as the kernel and e2fsprogs compute them.
+ */
+
+/**
+ * Pack len bytes of msg into num words, padding with the length. Chars are
+ * taken as signed or unsigned. Helper function for htree_hash.
+ */
+static void str2hashbuf(const char *msg, int len, unsigned int *buf, int num,
+                        int unsigned_chars) {
+    unsigned int pad = (unsigned int)len | ((unsigned int)len << 8);
+    pad |= pad << 16;
+    unsigned int val = pad;
+    if (len > num * 4) {
+        len = num * 4;
+    }
+    for (int i = 0; i < len; i++) {
+        int c = unsigned_chars ? (int)(unsigned char)msg[i] : (int)(signed char)msg[i];
+        val = c + (val << 8);
+        if (i % 4 == 3) {
+            *buf++ = val;
+            val = pad;
+            num--;
+        }
+    }
+    if (--num >= 0) {
+        *buf++ = val;
+    }
+    while (--num >= 0) {
+        *buf++ = pad;
+    }
+}
+
+static unsigned int rol32(unsigned int word, int shift) {
+    return (word << shift) | (word >> (32 - shift));
+}
+
+#define F(x, y, z) ((z) ^ ((x) & ((y) ^ (z))))
+#define G(x, y, z) (((x) & (y)) + (((x) ^ (y)) & (z)))
+#define H(x, y, z) ((x) ^ (y) ^ (z))
+#define ROUND(f, a, b, c, d, x, s) (a += f(b, c, d) + x, a = rol32(a, s))
+#define K1 0
+#define K2 013240474631U
+#define K3 015666365641U
+
+// Half of an MD4 round, on 8 words of input
+static void half_md4_transform(unsigned int buf[4], const unsigned int in[8]) {
+    unsigned int a = buf[0], b = buf[1], c = buf[2], d = buf[3];
+
+    ROUND(F, a, b, c, d, in[0] + K1, 3);
+    ROUND(F, d, a, b, c, in[1] + K1, 7);
+    ROUND(F, c, d, a, b, in[2] + K1, 11);
+    ROUND(F, b, c, d, a, in[3] + K1, 19);
+    ROUND(F, a, b, c, d, in[4] + K1, 3);
+    ROUND(F, d, a, b, c, in[5] + K1, 7);
+    ROUND(F, c, d, a, b, in[6] + K1, 11);
+    ROUND(F, b, c, d, a, in[7] + K1, 19);
+
+    ROUND(G, a, b, c, d, in[1] + K2, 3);
+    ROUND(G, d, a, b, c, in[3] + K2, 5);
+    ROUND(G, c, d, a, b, in[5] + K2, 9);
+    ROUND(G, b, c, d, a, in[7] + K2, 13);
+    ROUND(G, a, b, c, d, in[0] + K2, 3);
+    ROUND(G, d, a, b, c, in[2] + K2, 5);
+    ROUND(G, c, d, a, b, in[4] + K2, 9);
+    ROUND(G, b, c, d, a, in[6] + K2, 13);
+
+    ROUND(H, a, b, c, d, in[3] + K3, 3);
+    ROUND(H, d, a, b, c, in[7] + K3, 9);
+    ROUND(H, c, d, a, b, in[2] + K3, 11);
+    ROUND(H, b, c, d, a, in[6] + K3, 15);
+    ROUND(H, a, b, c, d, in[1] + K3, 3);
+    ROUND(H, d, a, b, c, in[5] + K3, 9);
+    ROUND(H, c, d, a, b, in[0] + K3, 11);
+    ROUND(H, b, c, d, a, in[4] + K3, 15);
+
+    buf[0] += a;
+    buf[1] += b;
+    buf[2] += c;
+    buf[3] += d;
+}
+
+// 16 rounds of TEA, on 4 words of input
+static void tea_transform(unsigned int buf[4], const unsigned int in[4]) {
+    unsigned int sum = 0;
+    unsigned int b0 = buf[0], b1 = buf[1];
+    unsigned int a = in[0], b = in[1], c = in[2], d = in[3];
+    for (int n = 0; n < 16; n++) {
+        sum += 0x9E3779B9;
+        b0 += ((b1 << 4) + a) ^ (b1 + sum) ^ ((b1 >> 5) + b);
+        b1 += ((b0 << 4) + c) ^ (b0 + sum) ^ ((b0 >> 5) + d);
+    }
+    buf[0] += b0;
+    buf[1] += b1;
+}
+
+// The hash of the first indexed directories
+static unsigned int dx_hack_hash(const char *name, int len, int unsigned_chars) {
+    unsigned int hash, hash0 = 0x12a3fe2d, hash1 = 0x37abe8f9;
+    for (int i = 0; i < len; i++) {
+        int c = unsigned_chars ? (int)(unsigned char)name[i] : (int)(signed char)name[i];
+        hash = hash1 + (hash0 ^ (c * 7152373));
+        if (hash & 0x80000000) {
+            hash -= 0x7fffffff;
+        }
+        hash1 = hash0;
+        hash0 = hash;
+    }
+    return hash0 << 1;
+}
+
+// Return the hash of the name for the hash version
+unsigned int htree_hash(const char *name, int len, int version) {
+    struct ext2_super_block *sb = get_super_block();
+    unsigned int buf[4] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476 };
+    unsigned int in[8];
+    unsigned int hash = 0;
+    int unsigned_chars = version >= DX_HASH_LEGACY_UNSIGNED;
+
+    // the seed of the super block replaces the default one, unless all zero
+    for (int i = 0; i < 4; i++) {
+        if (sb->s_hash_seed[i] != 0) {
+            memcpy(buf, sb->s_hash_seed, sizeof(buf));
+            break;
+        }
+    }
+
+    switch (version) {
+    case DX_HASH_LEGACY:
+    case DX_HASH_LEGACY_UNSIGNED:
+        hash = dx_hack_hash(name, len, unsigned_chars);
+        break;
+    case DX_HASH_HALF_MD4:
+    case DX_HASH_HALF_MD4_UNSIGNED:
+        for (; len > 0; len -= 32, name += 32) {
+            str2hashbuf(name, len, in, 8, unsigned_chars);
+            half_md4_transform(buf, in);
+        }
+        hash = buf[1];
+        break;
+    case DX_HASH_TEA:
+    case DX_HASH_TEA_UNSIGNED:
+        for (; len > 0; len -= 16, name += 16) {
+            str2hashbuf(name, len, in, 4, unsigned_chars);
+            tea_transform(buf, in);
+        }
+        hash = buf[0];
+        break;
+    }
+
+    // the lowest bit marks a hash continued from the previous block
+    hash &= ~1U;
+    if (hash == DX_HASH_EOF) {
+        hash = DX_HASH_EOF - 2;
+    }
+    return hash;
+}
+
+// Return the hash version a new index uses
+int htree_default_version() {
+    struct ext2_super_block *sb = get_super_block();
+    int version = sb->s_def_hash_version <= DX_HASH_TEA ?
+        sb->s_def_hash_version : DX_HASH_HALF_MD4;
+    if (sb->s_flags & EXT2_FLAGS_UNSIGNED_HASH) {
+        version += DX_HASH_LEGACY_UNSIGNED;
+    }
+    return version;
+}
+
+
+/*
+ * Reading the index.
+ */
+
+static struct dx_countlimit* countlimit(struct dx_entry *entries) {
+    return (struct dx_countlimit*)entries;
+}
+
+static int root_limit() {
+    return (block_size - DX_ROOT_INFO_OFFSET - sizeof(struct dx_root_info))
+        / sizeof(struct dx_entry);
+}
+
+static int node_limit() {
+    return (block_size - DX_NODE_ENTRIES_OFFSET) / sizeof(struct dx_entry);
+}
+
+// The logical block a dx_entry points to; the top bits are reserved
+static unsigned int dx_block(struct dx_entry *entry) {
+    return entry->block & 0x0fffffff;
+}
+
+// Return the block of the directory, or NULL if it is not mapped
+static unsigned char* dir_block(struct ext2_inode *inode, unsigned int logical) {
+    if ((unsigned long long)logical * block_size >= inode->i_size) {
+        return NULL;
+    }
+    unsigned int block = get_inode_block(inode, logical);
+    return block == 0 ? NULL : disk + block_size * block;
+}
+
+/**
+ * Return the dx_root_info of the directory, or NULL if it has no index or
+ * one this code does not handle.
+ */
+static struct dx_root_info* root_info(struct ext2_inode *inode) {
+    if (!(inode->i_flags & EXT2_INDEX_FL) || (inode->i_mode & 0xF000) != EXT2_S_IFDIR) {
+        return NULL;
+    }
+    unsigned char *root = dir_block(inode, 0);
+    if (root == NULL) {
+        return NULL;
+    }
+    struct dx_root_info *info = (struct dx_root_info*)(root + DX_ROOT_INFO_OFFSET);
+    if (info->reserved_zero != 0 || info->info_length != sizeof(struct dx_root_info) ||
+        info->hash_version > DX_HASH_TEA || info->indirect_levels > 1) {
+        return NULL;
+    }
+    struct dx_countlimit *cl = countlimit((struct dx_entry*)(info + 1));
+    if (cl->limit != root_limit() || cl->count == 0 || cl->count > cl->limit) {
+        return NULL;
+    }
+    return info;
+}
+
+// Return the entries of the node block, or NULL if it is not valid
+static struct dx_entry* node_entries(struct ext2_inode *inode, unsigned int logical) {
+    unsigned char *node = dir_block(inode, logical);
+    if (node == NULL) {
+        return NULL;
+    }
+    struct dx_entry *entries = (struct dx_entry*)(node + DX_NODE_ENTRIES_OFFSET);
+    struct dx_countlimit *cl = countlimit(entries);
+    if (cl->limit != node_limit() || cl->count == 0 || cl->count > cl->limit) {
+        return NULL;
+    }
+    return entries;
+}
+
+// Find the last entry whose hash is not greater than hash
+static struct dx_entry* search_entries(struct dx_entry *entries, unsigned int hash) {
+    struct dx_entry *p = entries + 1;
+    struct dx_entry *q = entries + countlimit(entries)->count - 1;
+    while (p <= q) {
+        struct dx_entry *m = p + (q - p) / 2;
+        if (m->hash > hash) {
+            q = m - 1;
+        } else {
+            p = m + 1;
+        }
+    }
+    return p - 1;
+}
+
+/**
+ * Go down the index of the inode to the leaf the name belongs to, filling
+ * the cursor. Return 0 on success, HTREE_UNINDEXED if there is no usable
+ * index.
+ */
+static int probe(struct htree_cursor *cursor, struct ext2_inode *inode, const char *name) {
+    struct dx_root_info *info = root_info(inode);
+    if (info == NULL) {
+        return HTREE_UNINDEXED;
+    }
+    int version = info->hash_version;
+    if (get_super_block()->s_flags & EXT2_FLAGS_UNSIGNED_HASH) {
+        version += DX_HASH_LEGACY_UNSIGNED;
+    }
+    cursor->inode = inode;
+    cursor->hash = htree_hash(name, strlen(name), version);
+    cursor->levels = info->indirect_levels;
+    cursor->entries[0] = (struct dx_entry*)(info + 1);
+    cursor->at[0] = search_entries(cursor->entries[0], cursor->hash);
+    if (cursor->levels == 1) {
+        cursor->entries[1] = node_entries(inode, dx_block(cursor->at[0]));
+        if (cursor->entries[1] == NULL) {
+            return HTREE_UNINDEXED;
+        }
+        cursor->at[1] = search_entries(cursor->entries[1], cursor->hash);
+    }
+    return 0;
+}
+
+// Return the leaf block the name belongs to
+int htree_first_leaf(struct htree_cursor *cursor, int directory, char *name) {
+    if (probe(cursor, get_inode(directory), name) != 0) {
+        return HTREE_UNINDEXED;
+    }
+    // "." and ".." are in the root block, not in the leaf of their hash;
+    // no other leaf follows them
+    if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+        cursor->levels = -1;
+        return get_inode_block(cursor->inode, 0);
+    }
+    unsigned int block = get_inode_block(cursor->inode, dx_block(cursor->at[cursor->levels]));
+    return block == 0 ? HTREE_UNINDEXED : block;
+}
+
+// Return the next leaf block names with the same hash continue to
+int htree_next_leaf(struct htree_cursor *cursor) {
+    if (cursor->levels < 0) {
+        return 0;
+    }
+    // move to the next entry, going up while an array is at its end
+    int level = cursor->levels;
+    while (++cursor->at[level] == cursor->entries[level] + countlimit(cursor->entries[level])->count) {
+        if (level == 0) {
+            return 0;
+        }
+        level--;
+    }
+    if ((cursor->at[level]->hash & ~1U) != cursor->hash) {
+        return 0;
+    }
+
+    // and down again to the first entries
+    for (; level < cursor->levels; level++) {
+        struct dx_entry *entries = node_entries(cursor->inode, dx_block(cursor->at[level]));
+        if (entries == NULL) {
+            return 0;
+        }
+        cursor->entries[level + 1] = entries;
+        cursor->at[level + 1] = entries;
+    }
+    return get_inode_block(cursor->inode, dx_block(cursor->at[cursor->levels]));
+}
+
+
+/*
+ * Changing the index.
+ */
+
+/**
+ * A live entry of a block being split: its hash, where it is and the space
+ * it needs. Helper type for split_leaf.
+ */
+struct dx_map_entry {
+    unsigned int hash;
+    unsigned short offset;
+    unsigned short size;
+};
+
+static int compare_map_entries(const void *a, const void *b) {
+    const struct dx_map_entry *x = a, *y = b;
+    if (x->hash != y->hash) {
+        return x->hash < y->hash ? -1 : 1;
+    }
+    return x->offset - y->offset;
+}
+
+// Space taken by an entry with a name of name_len bytes, rounded up to 4
+static int entry_size(int name_len) {
+    return (8 + name_len + 3) & ~3;
+}
+
+/**
+ * List the live entries of the block from byte start on into map, with
+ * their hash for the given hash version (or 0 if version is -1).
+ * Return the number of entries.
+ */
+static int map_entries(unsigned char *block, int start, struct dx_map_entry *map, int version) {
+    int n = 0;
+    for (int offset = start; offset < block_size; ) {
+        struct ext2_dir_entry *entry = (struct ext2_dir_entry*)(block + offset);
+        if (entry->rec_len == 0) {
+            break;
+        }
+        if (entry->inode != 0 && entry->name_len != 0) {
+            map[n].hash = version < 0 ? 0 : htree_hash(entry->name, entry->name_len, version);
+            map[n].offset = offset;
+            map[n].size = entry_size(entry->name_len);
+            n++;
+        }
+        offset += entry->rec_len;
+    }
+    return n;
+}
+
+/**
+ * Write the n entries of the map, taken from the copy of a block, one after
+ * the other into block, the last one taking the rest of the block.
+ */
+static void pack_entries(unsigned char *block, unsigned char *copy, struct dx_map_entry *map, int n) {
+    memset(block, 0, block_size);
+    if (n == 0) {
+        ((struct ext2_dir_entry*)block)->rec_len = block_size;
+        mark_changed(block, block_size, CHANGE_METADATA);
+        return;
+    }
+    int offset = 0;
+    struct ext2_dir_entry *entry = NULL;
+    for (int i = 0; i < n; i++) {
+        struct ext2_dir_entry *from = (struct ext2_dir_entry*)(copy + map[i].offset);
+        entry = (struct ext2_dir_entry*)(block + offset);
+        memcpy(entry, from, 8 + from->name_len);
+        entry->rec_len = map[i].size;
+        offset += map[i].size;
+    }
+    entry->rec_len += block_size - offset;
+    mark_changed(block, block_size, CHANGE_METADATA);
+}
+
+/**
+ * Add a block at the end of the directory, near its last block, and zero it.
+ * Set *block to it and return its logical number. Exit if the disk is full,
+ * as create_directory does.
+ */
+static unsigned int append_block(struct ext2_inode *inode, unsigned int *block) {
+    unsigned int logical = inode->i_size / block_size;
+    struct block_pool pool = { .goal = get_inode_block(inode, logical - 1) + 1 };
+    int new_block = map_new_block(inode, logical, &pool);
+    if (new_block == ERR_NO_BLOCK) {
+        fprintf(stderr, "There is no space left on disk\n");
+        exit(-ENOSPC);
+    }
+    inode->i_size += block_size;
+    memset(disk + block_size * new_block, 0, block_size);
+    mark_changed(disk + block_size * new_block, block_size, CHANGE_METADATA);
+    *block = new_block;
+    return logical;
+}
+
+// Insert a dx_entry after at
+static void insert_dx_entry(struct dx_entry *entries, struct dx_entry *at,
+                            unsigned int hash, unsigned int block) {
+    struct dx_countlimit *cl = countlimit(entries);
+    struct dx_entry *end = entries + cl->count;
+    memmove(at + 2, at + 1, (end - (at + 1)) * sizeof(struct dx_entry));
+    at[1].hash = hash;
+    at[1].block = block;
+    cl->count++;
+    mark_changed(entries, cl->count * sizeof(struct dx_entry), CHANGE_METADATA);
+}
+
+/**
+ * Make room for one more dx_entry in the last level of the index the cursor
+ * went through: move a full root into a new node, or split a full node in
+ * two. Return 0 on success, -1 if the index is as deep and full as it can be.
+ */
+static int grow_index(struct htree_cursor *cursor) {
+    struct ext2_inode *inode = cursor->inode;
+    unsigned int block;
+
+    if (cursor->levels == 0) {
+        // the entries of the root move to a node, the only one of the root
+        struct dx_entry *root = cursor->entries[0];
+        int count = countlimit(root)->count;
+        unsigned int logical = append_block(inode, &block);
+        unsigned char *node = disk + block_size * block;
+        ((struct ext2_dir_entry*)node)->rec_len = block_size;
+        struct dx_entry *entries = (struct dx_entry*)(node + DX_NODE_ENTRIES_OFFSET);
+        memcpy(entries, root, count * sizeof(struct dx_entry));
+        countlimit(entries)->limit = node_limit();
+        countlimit(root)->count = 1;
+        root[0].block = logical;
+        ((struct dx_root_info*)root - 1)->indirect_levels = 1;
+        mark_changed((struct dx_root_info*)root - 1,
+                     sizeof(struct dx_root_info) + sizeof(struct dx_entry), CHANGE_METADATA);
+        return 0;
+    }
+
+    struct dx_entry *root = cursor->entries[0];
+    if (countlimit(root)->count == countlimit(root)->limit) {
+        return -1;
+    }
+    // the upper half of the node moves to a new node, listed in the root
+    struct dx_entry *entries = cursor->entries[1];
+    int count = countlimit(entries)->count;
+    int moved = count / 2;
+    unsigned int logical = append_block(inode, &block);
+    unsigned char *node = disk + block_size * block;
+    ((struct ext2_dir_entry*)node)->rec_len = block_size;
+    struct dx_entry *new_entries = (struct dx_entry*)(node + DX_NODE_ENTRIES_OFFSET);
+    memcpy(new_entries, entries + count - moved, moved * sizeof(struct dx_entry));
+    unsigned int hash = new_entries[0].hash;
+    countlimit(new_entries)->limit = node_limit();
+    countlimit(new_entries)->count = moved;
+    countlimit(entries)->count = count - moved;
+    mark_changed(entries, sizeof(struct dx_entry), CHANGE_METADATA);
+    insert_dx_entry(root, cursor->at[0], hash, logical);
+    return 0;
+}
+
+/**
+ * Split the full leaf the cursor points to: the entries are sorted by hash
+ * and the upper half moves to a new block, listed in the index after the
+ * leaf. Then add the entry for name to the half it belongs to.
+ * Return the entry, or NULL if it still does not fit.
+ */
+static struct ext2_dir_entry* split_leaf(struct htree_cursor *cursor, unsigned int leaf,
+                                         char *name, int version) {
+    unsigned char *old = disk + block_size * leaf;
+    unsigned char copy[block_size];
+    struct dx_map_entry map[block_size / 12 + 1];
+    memcpy(copy, old, block_size);
+    int n = map_entries(copy, 0, map, version);
+    qsort(map, n, sizeof(struct dx_map_entry), compare_map_entries);
+
+    // take entries from the end until half of the space in use is moved,
+    // but leave at least one in each block
+    int total = 0;
+    for (int i = 0; i < n; i++) {
+        total += map[i].size;
+    }
+    int split = n;
+    int moved = 0;
+    while (split > 1 && moved < total / 2) {
+        split--;
+        moved += map[split].size;
+    }
+    if (split == n) {
+        return NULL;
+    }
+    unsigned int split_hash = map[split].hash;
+    // names with this hash may be in both blocks, which the low bit tells
+    int continued = map[split - 1].hash == split_hash;
+
+    unsigned int block;
+    unsigned int logical = append_block(cursor->inode, &block);
+    unsigned char *new = disk + block_size * block;
+    pack_entries(new, copy, map + split, n - split);
+    pack_entries(old, copy, map, split);
+    insert_dx_entry(cursor->entries[cursor->levels], cursor->at[cursor->levels],
+                    split_hash | continued, logical);
+
+    return find_space_in_block(cursor->hash >= split_hash ? new : old, name);
+}
+
+// Stop using the index; its blocks read as empty entries without it. The
+// kernel or e2fsck may rebuild it later, so this is said
+static void drop_index(int directory, struct ext2_inode *inode) {
+    fprintf(stderr, "The index of directory inode [%d] cannot be updated and is dropped\n",
+            directory);
+    inode->i_flags &= ~EXT2_INDEX_FL;
+    mark_changed(inode, sizeof(struct ext2_inode), CHANGE_METADATA);
+}
+
+// Add an entry to the indexed directory
+struct ext2_dir_entry* htree_add_entry(int directory, char *name) {
+    struct ext2_inode *inode = get_inode(directory);
+    if (!(inode->i_flags & EXT2_INDEX_FL)) {
+        return NULL;
+    }
+
+    // each round either adds the entry or makes room for it, which can take
+    // a new level, a node split and a leaf split
+    struct htree_cursor cursor;
+    for (int round = 0; round < 4; round++) {
+        if (probe(&cursor, inode, name) != 0) {
+            break;
+        }
+        unsigned int leaf = get_inode_block(inode, dx_block(cursor.at[cursor.levels]));
+        if (leaf == 0) {
+            break;
+        }
+        struct ext2_dir_entry *entry = find_space_in_block(disk + block_size * leaf, name);
+        if (entry != NULL) {
+            return entry;
+        }
+
+        // splitting the leaf adds an entry to the last level of the index
+        struct dx_entry *entries = cursor.entries[cursor.levels];
+        if (countlimit(entries)->count < countlimit(entries)->limit) {
+            int version = ((struct dx_root_info*)cursor.entries[0] - 1)->hash_version;
+            if (get_super_block()->s_flags & EXT2_FLAGS_UNSIGNED_HASH) {
+                version += DX_HASH_LEGACY_UNSIGNED;
+            }
+            entry = split_leaf(&cursor, leaf, name, version);
+            if (entry != NULL) {
+                return entry;
+            }
+        } else if (grow_index(&cursor) != 0) {
+            break;
+        }
+    }
+    drop_index(directory, inode);
+    return NULL;
+}
+
+// Turn the single block directory into an indexed one and add an entry
+struct ext2_dir_entry* htree_index_directory(int directory, char *name) {
+    struct ext2_super_block *sb = get_super_block();
+    struct ext2_inode *inode = get_inode(directory);
+    if (!(sb->s_feature_compat & EXT2_FEATURE_COMPAT_DIR_INDEX) ||
+        (inode->i_flags & EXT2_INDEX_FL) || inode->i_size != block_size) {
+        return NULL;
+    }
+    unsigned char *root = dir_block(inode, 0);
+    if (root == NULL) {
+        return NULL;
+    }
+    // the root keeps "." and "..", which must come first as usual
+    struct ext2_dir_entry *dot = (struct ext2_dir_entry*)root;
+    struct ext2_dir_entry *dotdot = (struct ext2_dir_entry*)(root + 12);
+    if (dot->rec_len != 12 || dot->name_len != 1 || dot->name[0] != '.' ||
+        dotdot->name_len != 2 || dotdot->name[0] != '.' || dotdot->name[1] != '.' ||
+        12 + dotdot->rec_len > block_size) {
+        return NULL;
+    }
+
+    // the other entries move to the first leaf
+    unsigned char copy[block_size];
+    struct dx_map_entry map[block_size / 12 + 1];
+    memcpy(copy, root, block_size);
+    int n = map_entries(copy, 12 + dotdot->rec_len, map, -1);
+    unsigned int leaf;
+    unsigned int logical = append_block(inode, &leaf);
+    pack_entries(disk + block_size * leaf, copy, map, n);
+
+    // and the root points to it for every hash
+    dotdot->rec_len = block_size - 12;
+    memset(root + DX_ROOT_INFO_OFFSET, 0, block_size - DX_ROOT_INFO_OFFSET);
+    struct dx_root_info *info = (struct dx_root_info*)(root + DX_ROOT_INFO_OFFSET);
+    info->hash_version = sb->s_def_hash_version <= DX_HASH_TEA ?
+        sb->s_def_hash_version : DX_HASH_HALF_MD4;
+    info->info_length = sizeof(struct dx_root_info);
+    struct dx_entry *entries = (struct dx_entry*)(info + 1);
+    countlimit(entries)->limit = root_limit();
+    countlimit(entries)->count = 1;
+    entries[0].block = logical;
+    inode->i_flags |= EXT2_INDEX_FL;
+    mark_changed(root, block_size, CHANGE_METADATA);
+    mark_changed(inode, sizeof(struct ext2_inode), CHANGE_METADATA);
+
+    return htree_add_entry(directory, name);
+}
@@ -0,0 +1,60 @@
+// Returned for a directory without a hash index that can be used
+#define HTREE_UNINDEXED -5
+
+/**
+ * Position in the hash index of a directory, between htree_first_leaf and
+ * htree_next_leaf. The fields are private to htree.c.
+ */
+struct htree_cursor {
+    struct ext2_inode *inode;
+    unsigned int hash;
+    int levels;
+    struct dx_entry *entries[2];
+    struct dx_entry *at[2];
+};
+
+/**
+ * Return the hash of the name (of length len) used by the index of
+ * directories, for the given hash version (DX_HASH_*), with the seed of the
+ * super block.
+ */
+unsigned int htree_hash(const char *name, int len, int version);
+
+/**
+ * Return the hash version (DX_HASH_*) a new index on this file system uses,
+ * as htree_hash takes it.
+ */
+int htree_default_version();
+
+/**
+ * Find the leaf block of the directory (inode number) the name belongs to;
+ * for "." and "..", the root block of the index that holds them.
+ * Return the block, or HTREE_UNINDEXED if the directory has no index that
+ * can be used (in which case all of its blocks must be searched).
+ */
+int htree_first_leaf(struct htree_cursor *cursor, int directory, char *name);
+
+/**
+ * Return the next leaf block that may hold the name after a previous one,
+ * when names with the same hash continue there, or 0 if there is none.
+ */
+int htree_next_leaf(struct htree_cursor *cursor);
+
+/**
+ * Add an entry for name to the indexed directory (inode number), splitting
+ * its leaf and growing the index when needed. The inode and file_type of
+ * the entry are left unset, as in create_directory.
+ * Return the entry, or NULL if the directory has no index. An index that
+ * cannot be kept up to date (a format not handled here, or a full tree) is
+ * dropped, with a message on stderr, and the directory goes on as an
+ * ordinary one.
+ */
+struct ext2_dir_entry* htree_add_entry(int directory, char *name);
+
+/**
+ * Turn the directory (inode number), made of a single full block, into an
+ * indexed directory and add an entry for name to it.
+ * Return the entry, or NULL if the directory cannot be indexed, which is
+ * also the case when the file system does not have the dir_index feature.
+ */
+struct ext2_dir_entry* htree_index_directory(int directory, char *name);
@@ -0,0 +1,592 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <errno.h>
+#include <assert.h>
+#include <string.h>
+#include <time.h>
+#include "path.h"
+#include "ops.h"
+#include "ext2.h"
+
+// The directory the last path was found in, as written in that path, and
+// its inode. Paths given one after the other are often in the same
+// directory; no operation removes or moves a directory, so it stays valid.
+static char *last_directory = NULL;
+static int last_directory_inode;
+
+/**
+ * Return the inode of the directory holding the last token of the path
+ * (arg as given, parsed into path and length), or -ENOENT.
+ */
+static int find_directory(char *arg, char **path, int length) {
+    // the directory part of arg: up to the slash before the last token
+    size_t end = strlen(arg);
+    while (end > 1 && arg[end - 1] == '/') {
+        end--;
+    }
+    while (end > 0 && arg[end - 1] != '/') {
+        end--;
+    }
+    if (last_directory != NULL && strlen(last_directory) == end &&
+        strncmp(last_directory, arg, end) == 0) {
+        return last_directory_inode;
+    }
+
+    int directory = trace_path(path, length - 1);
+    if (directory != -ENOENT) {
+        free(last_directory);
+        last_directory = strndup(arg, end);
+        last_directory_inode = directory;
+    }
+    return directory;
+}
+
+// Create the directory
+int op_mkdir(char *dir_path) {
+    // find destination
+    int length;
+    char **path = parse_path(dir_path, &length);
+    if (path == NULL) {
+        return -1;
+    }
+    int result = 0;
+    // find the parent and check whether the file already exists, noting
+    // where the new entry can go on the way
+    struct dir_slot slot;
+    char type;
+    int find_result = lookup_or_reserve(path, length, &slot, &type);
+    if (find_result == -ENOENT) {
+        fprintf(stderr, "This path doesn't exist\n");
+        result = -ENOENT;
+        goto cleanup;
+    } else if (find_result > 0) {
+        fprintf(stderr, "There is a file has the name of the directory to create\n");
+        result = -EEXIST;
+        goto cleanup;
+    }
+    int target_directory = slot.directory;
+
+    // allocate inode for the new directory, close to its parent
+    int new_inode = allocate_inode_near(target_directory);
+    if (new_inode == ERR_NO_INODE) {
+        fprintf(stderr, "There is no inode available\n");
+        result = -ENOSPC;
+        goto cleanup;
+    }
+
+    // set up info in inode; a reused inode keeps the fields of the file it
+    // held, i_flags among them, so it starts from zeros
+    struct ext2_inode *this_inode = get_inode(new_inode + 1);
+    memset(this_inode, 0, sizeof(struct ext2_inode));
+    this_inode->i_mode = EXT2_S_IFDIR;
+    this_inode->i_size = block_size;
+    this_inode->i_links_count = 2;
+    this_inode->i_blocks = block_size / 512;
+
+    // allocate block for the new directory in the group of its inode
+    int new_block = allocate_block_near(group_first_block(inode_group(new_inode + 1)));
+    if (new_block == ERR_NO_BLOCK) {
+        release_inode(new_inode + 1);
+        fprintf(stderr, "There is no free block on the disk. \n");
+        result = -ENOSPC;
+        goto cleanup;
+    }
+    this_inode->i_block[0] = new_block;
+    mark_changed(this_inode, sizeof(struct ext2_inode), CHANGE_METADATA);
+
+    // add the directory to its parent directory
+    struct ext2_dir_entry *new_entry = add_reserved_entry(&slot, path[length-1]);
+    new_entry->inode = new_inode + 1;
+    new_entry->file_type = EXT2_FT_DIR;
+
+    // set up the first two block entry "." and ".."
+    // the block may hold the data of a removed file
+    unsigned char *this_block = disk + block_size * new_block;
+    memset(this_block, 0, block_size);
+    struct ext2_dir_entry *cur_entry = (struct ext2_dir_entry*)this_block;
+    cur_entry[0].inode = new_inode + 1;
+    cur_entry[0].name_len = 1;
+    cur_entry[0].file_type = EXT2_FT_DIR;
+    cur_entry[0].name[0] = '.';
+    cur_entry[0].name_len = 1;
+    // The actual size is 9, but this should be a multiple of 4
+    cur_entry[0].rec_len = 12;
+
+    cur_entry = (struct ext2_dir_entry*)(this_block+12);
+    cur_entry[0].inode = target_directory;
+    cur_entry[0].name_len = 2;
+    cur_entry[0].file_type = EXT2_FT_DIR;
+    cur_entry[0].name[0] = '.';
+    cur_entry[0].name[1] = '.';
+    //The actual size is 10, but this is currently the last entry
+    // rec_len is set to be the rest of the block
+    cur_entry[0].rec_len = block_size - 12;
+    mark_changed(this_block, block_size, CHANGE_METADATA);
+    
+    get_group_desc(inode_group(new_inode + 1))->bg_used_dirs_count++;
+    mark_changed(get_group_desc(inode_group(new_inode + 1)), sizeof(struct ext2_group_desc),
+                 CHANGE_METADATA);
+    // Increase the link count of the parent directory
+    struct ext2_inode *parent = get_inode(target_directory);
+    parent->i_links_count++;
+    mark_changed(parent, sizeof(struct ext2_inode), CHANGE_METADATA);
+
+cleanup:
+    free_path(path, length);
+    return result;
+}
+
+// Copy the file from the local file system into the image
+int op_cp(char *source_path, char *dest_path) {
+    // open source file
+    int fd_s = open(source_path, O_RDONLY);
+    if(fd_s == -1){
+        perror("open");
+        return -ENOENT;
+    }
+    // what is released on the way out, whatever the way
+    int result = 0;
+    char **path = NULL;
+    int length = 0;
+    unsigned char *source = NULL;
+    unsigned char *has_data = NULL;
+    struct block_run *runs = NULL;
+
+
+    // get source file size
+    struct stat st;
+    fstat(fd_s, &st);
+
+    // check if the file to copy is regular file
+    if((st.st_mode & S_IFMT) != S_IFREG){
+        fprintf(stderr, "Source file is not regular file.\n");
+        result = -ENOENT;
+        goto cleanup;
+    }
+
+
+    // check the size of the file to copy against what the direct, single,
+    // double and triple indirect blocks can map, and the 64-bit i_size
+    unsigned long long p = pointers_per_block;
+    unsigned long long max_blocks = EXT2_NDIR_BLOCKS + p + p * p + p * p * p;
+    if(max_blocks > 0xFFFFFFFF){
+        max_blocks = 0xFFFFFFFF;
+    }
+    if(st.st_size > max_blocks * block_size){
+        fprintf(stderr, "Source file is too large.\n");
+        result = -ENOSPC;
+        goto cleanup;
+    }
+
+    // find destination
+    path = parse_path(dest_path, &length);
+    if (path == NULL) {
+        result = -1;
+        goto cleanup;
+    }
+    struct dir_slot slot;
+    char type;
+    int find_result = lookup_or_reserve(path, length, &slot, &type);
+    if (find_result == -ENOENT) {
+        fprintf(stderr, "The path to destination is invalid.\n");
+        result = -ENOENT;
+        goto cleanup;
+    } else if (find_result > 0) {
+        fprintf(stderr, "File to create already exists.\n");
+        result = -EEXIST;
+        goto cleanup;
+    }
+    int target_directory = slot.directory;
+
+
+    // Allocate inode for new file, in the group of its directory if possible
+    int new_inode = allocate_inode_near(target_directory);
+    if (new_inode == ERR_NO_INODE) {
+        fprintf(stderr, "There is no free inode.\n");
+        result = -ENOSPC;
+        goto cleanup;
+    }
+
+
+    // map the source, to look for zero blocks and copy from
+    if (st.st_size > 0) {
+        source = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd_s, 0);
+        if (source == MAP_FAILED) {
+            source = NULL;
+        } else {
+            madvise(source, st.st_size, MADV_SEQUENTIAL);
+        }
+    }
+
+
+    // find the blocks holding data: the holes of the source and the blocks
+    // that are all zeros stay holes (0 entries) in the copy
+    unsigned int data_blocks = (st.st_size + block_size - 1) / block_size;
+    has_data = calloc(data_blocks > 0 ? data_blocks : 1, 1);
+    if (has_data == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    off_t data_start = 0;
+    while (data_start < st.st_size) {
+        off_t next = lseek(fd_s, data_start, SEEK_DATA);
+        // ENXIO: only a hole is left; otherwise holes are not supported,
+        // and the rest of the file is taken as data
+        if (next < 0 && errno == ENXIO) {
+            break;
+        }
+        off_t data_end = st.st_size;
+        if (next >= 0) {
+            data_start = next;
+            data_end = lseek(fd_s, data_start, SEEK_HOLE);
+            if (data_end < 0 || data_end > st.st_size) {
+                data_end = st.st_size;
+            }
+        }
+        for (unsigned int i = data_start / block_size; (off_t)i * block_size < data_end; i++) {
+            off_t offset = (off_t)i * block_size;
+            size_t length = st.st_size - offset < block_size ? st.st_size - offset : block_size;
+            has_data[i] = source == NULL || !is_zero_block(source + offset, length);
+        }
+        data_start = data_end;
+    }
+
+
+    // Reserve every block of the file at once: the data blocks and the
+    // indirect blocks needed to map them.
+    // The runs are laid out from the start of the inode's group.
+    int total_blocks = 0;
+    long long previous = -1;
+    for (unsigned int i = 0; i < data_blocks; i++) {
+        if (has_data[i]) {
+            total_blocks += 1 + count_new_indirect_blocks(previous, i);
+            previous = i;
+        }
+    }
+    int run_count = allocate_blocks(group_first_block(inode_group(new_inode + 1)),
+                                    total_blocks, &runs);
+    if (run_count == ERR_NO_BLOCK) {
+        release_inode(new_inode + 1);
+        fprintf(stderr, "There is no free block on the disk.\n");
+        result = -ENOSPC;
+        goto cleanup;
+    }
+
+
+    // Add file to target_directory
+    struct ext2_dir_entry *new_entry = add_reserved_entry(&slot, path[length-1]);
+    new_entry->inode = new_inode + 1;
+    new_entry->file_type = EXT2_FT_REG_FILE;
+    
+
+    // setting inode fields for new file, from zeros
+    struct ext2_inode *this_inode = get_inode(new_inode + 1);
+    memset(this_inode, 0, sizeof(struct ext2_inode));
+    this_inode->i_mode = EXT2_S_IFREG;
+    this_inode->i_links_count = 1;
+    set_inode_size(this_inode, st.st_size);
+
+
+    // set up i_block and i_blocks, taking the reserved blocks in order;
+    // map_new_block puts each indirect block before the data it maps
+    struct block_pool pool = { .runs = runs, .run_count = run_count };
+    for (unsigned int i = 0; i < data_blocks; i++) {
+        if (has_data[i]) {
+            map_new_block(this_inode, i, &pool);
+        }
+    }
+
+
+    // copy the data one run of contiguous blocks at a time, straight from
+    // the mapped source if it can be mapped, or read into the image if not
+    struct block_iter it;
+    unsigned int logical, block;
+    int count;
+    block_iter_init(&it, this_inode, BLOCK_ITER_DATA);
+    while ((count = block_iter_next(&it, &logical, &block)) > 0) {
+        unsigned char *dest = disk + block_size * block;
+        off_t offset = (off_t)logical * block_size;
+        size_t length = (size_t)count * block_size;
+        mark_changed(dest, length, CHANGE_DATA);
+        // the last block is only partly used, zero the rest of it
+        if (offset + length > st.st_size) {
+            length = st.st_size - offset;
+            memset(dest + length, 0, (size_t)count * block_size - length);
+        }
+        if (source != NULL) {
+            memcpy(dest, source + offset, length);
+            continue;
+        }
+        while (length > 0) {
+            ssize_t n = pread(fd_s, dest, length, offset);
+            if (n < 0) {
+                perror("read");
+                exit(1);
+            }
+            if (n == 0) {
+                // the source shrank since it was checked, keep zeros
+                memset(dest, 0, length);
+                break;
+            }
+            dest += n;
+            offset += n;
+            length -= n;
+        }
+    }
+
+
+cleanup:
+    if (source != NULL) {
+        munmap(source, st.st_size);
+    }
+    free(runs);
+    free(has_data);
+    free_path(path, length);
+    close(fd_s);
+    return result;
+}
+
+// Create a hard link, or a symbolic link if symbolic is set, to the source
+int op_ln(char *source_path, char *dest_path, int symbolic) {
+    // find source
+    int len_s;
+    char **path_s = parse_path(source_path, &len_s);
+    if (path_s == NULL) {
+        return -1;
+    }
+    int result = 0;
+    char **path = NULL;
+    int length = 0;
+    int source_directory = find_directory(source_path, path_s, len_s);
+    if (source_directory == -ENOENT) {
+        fprintf(stderr, "The path to source file is invalid. \n");
+        result = -ENOENT;
+        goto cleanup;
+    }
+
+
+    // find the inode for source file
+    int source_inode = find_in_inode(source_directory, path_s[len_s-1], 'f'); 
+    if (source_inode == ERR_NOT_EXIST) {
+        fprintf(stderr, "Source file doesn't exist\n");
+        result = -ENOENT;
+        goto cleanup;
+    }else if(source_inode == ERR_WRONG_TYPE){
+        // Search again to see if this is a symbolic link
+        source_inode = find_in_inode(source_directory, path_s[len_s-1], 'l');
+        if (source_inode == ERR_WRONG_TYPE) {
+            // if work on hardlink
+            if(!symbolic){
+                fprintf(stderr, "Source file is not a regular file\n");
+                result = -EISDIR;
+                goto cleanup;
+            }
+        }
+    }
+
+
+    // find destination
+    path = parse_path(dest_path, &length);
+    if (path == NULL) {
+        result = -1;
+        goto cleanup;
+    }
+    struct dir_slot slot;
+    char type;
+    int find_result = lookup_or_reserve(path, length, &slot, &type);
+    if (find_result == -ENOENT) {
+        fprintf(stderr, "The path to destination is invalid. \n");
+        result = -ENOENT;
+        goto cleanup;
+    } else if (find_result > 0) {
+        fprintf(stderr, "There is a file has the name of the link to create\n");
+        result = -EEXIST;
+        goto cleanup;
+    }
+    int target_directory = slot.directory;
+
+
+    // if target is hard link
+    if(!symbolic){
+        struct ext2_dir_entry *new_entry = add_reserved_entry(&slot, path[length-1]);
+        new_entry->inode = source_inode;
+        new_entry->file_type = EXT2_FT_REG_FILE;
+
+        // Increase source file link count
+        struct ext2_inode *this_inode = get_inode(source_inode);
+        this_inode->i_links_count ++;
+        mark_changed(this_inode, sizeof(struct ext2_inode), CHANGE_METADATA);
+
+    // if target is soft link
+    }else{
+        int new_inode = allocate_inode_near(target_directory);
+        if (new_inode == -1) {
+            fprintf(stderr, "There is no inode available\n");
+            result = -ENOSPC;
+            goto cleanup;
+        }
+
+        // setting inode fields, from zeros
+        struct ext2_inode *this_inode = get_inode(new_inode + 1);
+        memset(this_inode, 0, sizeof(struct ext2_inode));
+        this_inode->i_mode = EXT2_S_IFLNK;
+        this_inode->i_links_count = 1;
+        this_inode->i_size = strlen(source_path); 
+
+        // allocate new block to store link
+        int new_block = allocate_block_near(group_first_block(inode_group(new_inode + 1)));
+        if (new_block == -1) {
+            release_inode(new_inode + 1);
+            fprintf(stderr, "There is no space on the disk!");
+            result = -ENOSPC;
+            goto cleanup;
+        }
+        this_inode->i_block[0] = new_block;
+        this_inode->i_blocks += block_size / 512;
+        mark_changed(this_inode, sizeof(struct ext2_inode), CHANGE_METADATA);
+
+        // copying path into data block
+        char *this_block = (char*)(disk + block_size * new_block);
+        memset(this_block, 0, block_size);
+        strncpy(this_block, source_path, strlen(source_path));
+        mark_changed(this_block, block_size, CHANGE_DATA);
+
+        struct ext2_dir_entry *new_entry = add_reserved_entry(&slot, path[length-1]);
+        new_entry->inode = new_inode + 1;
+        new_entry->file_type = EXT2_FT_SYMLINK;
+    }
+
+cleanup:
+    free_path(path_s, len_s);
+    free_path(path, length);
+    return result;
+}
+
+// Remove the file or link
+int op_rm(char *file_path) {
+    int length;
+    char **path = parse_path(file_path, &length);
+    if (path == NULL) {
+        fprintf(stderr, "Invalid Path\n");
+        return -1;
+    }
+    int result = 0;
+    int target_directory = find_directory(file_path, path, length);
+    if (target_directory == -ENOENT) {
+        fprintf(stderr, "The path to the file to delete is invalid. \n");
+        result = -ENOENT;
+        goto cleanup;
+    }
+
+
+    // check whether the file to delete exists and not a directory
+    int find_result = find_in_inode(target_directory, path[length-1], 'f');
+    if (find_result == ERR_WRONG_TYPE) {
+        find_result = find_in_inode(target_directory, path[length-1], 'l');
+        if (find_result == ERR_WRONG_TYPE) {
+            fprintf(stderr, "%s is a directory\n", file_path);
+            result = -ENOENT;
+            goto cleanup;
+        }
+    } else if (find_result == ERR_NOT_EXIST) {
+        fprintf(stderr, "File to delete does not exist. \n");
+        result = -ENOENT;
+        goto cleanup;
+    }
+
+    //find the directory entry of the file and delete it
+    delete_entry(target_directory, path[length-1]);
+
+
+    // update link counts
+    struct ext2_inode *delete_file = get_inode(find_result);
+    delete_file->i_links_count--;
+    mark_changed(delete_file, sizeof(struct ext2_inode), CHANGE_METADATA);
+    // if the file is not actually deleted
+    if (delete_file->i_links_count != 0) {
+        goto cleanup;
+    }
+
+
+    // otherwise,  update delete time, inode bitmap, block bitmap, group descriptor and super block
+    time_t delete_time;
+    time(&delete_time);
+    delete_file->i_dtime = delete_time;
+
+    // update inode
+    release_inode(find_result);
+
+    // update block, the data blocks and the indirect blocks at every level
+    release_inode_blocks(delete_file);
+
+cleanup:
+    free_path(path, length);
+    return result;
+}
+
+// Restore the removed file or link
+int op_restore(char *file_path) {
+    int length;
+    char **path = parse_path(file_path, &length);
+    if (path == NULL) {
+        fprintf(stderr, "The path to file is invalid. \n");
+        return -1;
+    }
+    int status = -ENOENT;
+    int target_directory = find_directory(file_path, path, length);
+    if (target_directory == -ENOENT) {
+        fprintf(stderr, "The path to file is invalid. \n");
+        goto cleanup;
+    }
+
+    // Check whether the file to restore already exist
+    int result = find_in_inode(target_directory, path[length-1], 'f');
+    if (result > 0 || result == ERR_WRONG_TYPE) {
+        fprintf(stderr, "The file you want to restor is already in directory\n");
+        status = -EEXIST;
+        goto cleanup;
+    }
+
+    // find to file to restore and restore it
+    result = restore_entry(target_directory, path[length-1]);
+    if (result == RESTORE_SUCCESS) {
+        status = 0;
+    } else if (result == ERR_WRONG_TYPE) {
+        fprintf(stderr, "The file trying to restore is a directory\n");
+    } else if (result == ERR_OVERWRITTEN) {
+        fprintf(stderr, "The file trying to restore has been overwritten\n");
+    } else {
+        fprintf(stderr, "The file you want to restore is not found\n");
+    }
+
+cleanup:
+    free_path(path, length);
+    return status;
+}
+
+// Compact the directory
+int op_compact_dir(char *dir_path, int order) {
+    int length;
+    char **path = parse_path(dir_path, &length);
+    if (path == NULL) {
+        fprintf(stderr, "Invalid Path\n");
+        return -1;
+    }
+    int directory = trace_path(path, length);
+    free_path(path, length);
+    if (directory == -ENOENT) {
+        fprintf(stderr, "The directory to compact does not exist. \n");
+        return -ENOENT;
+    }
+
+    int released = compact_directory(directory, order);
+    printf("%s: %u blocks, %d released\n", dir_path,
+           get_inode(directory)->i_size / (unsigned int)block_size, released);
+    return 0;
+}
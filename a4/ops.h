@@ -0,0 +1,43 @@
+/**
+ * The operations of the tools, run against the image opened by open_image.
+ * Each one prints its error and returns a negative errno value (or -1 for a
+ * malformed path) on failure, and returns 0 on success. Paths in the image
+ * are absolute.
+ */
+
+/**
+ * Create the directory at path, like mkdir.
+ */
+int op_mkdir(char *path);
+
+/**
+ * Copy the regular file at source_path on the local file system to
+ * dest_path in the image. Blocks of the source that are holes or all zeros
+ * are left as holes.
+ */
+int op_cp(char *source_path, char *dest_path);
+
+/**
+ * Create at dest_path a hard link to the file at source_path, or a symbolic
+ * link holding source_path if symbolic is not 0.
+ */
+int op_ln(char *source_path, char *dest_path, int symbolic);
+
+/**
+ * Remove the file or link at path, freeing its inode and blocks once its
+ * last link is gone.
+ */
+int op_rm(char *path);
+
+/**
+ * Restore the removed file or link at path, if its entry, inode and blocks
+ * have not been reused since.
+ */
+int op_restore(char *path);
+
+/**
+ * Repack the entries of the directory at path into as few blocks as they
+ * fit in, in the given order (COMPACT_*), releasing the blocks left empty.
+ * Removed entries in it can no longer be restored.
+ */
+int op_compact_dir(char *path, int order);
@@ -3,8 +3,17 @@
 #include <stdio.h>
 #include <errno.h>
 #include <assert.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 #include "path.h"
+#include "htree.h"
 #include "ext2.h"
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 /**
  * Helper function for restore_entry_in_block. 
@@ -14,33 +23,983 @@
  */ 
 static int restore_inode(int index);
 
+static int find_next_bit(const unsigned char *bitmap, int start, int nbits, int value);
+
+/**
+ * Call fn with the block size as its first argument. For the block sizes
+ * mke2fs creates the size is passed as a constant, so that a copy of an
+ * always inlined fn with fixed loop bounds is built for each of them.
+ */
+#define WITH_BLOCK_SIZE(fn, ...) \
+    (block_size == 1024 ? fn(1024, __VA_ARGS__) : \
+     block_size == 2048 ? fn(2048, __VA_ARGS__) : \
+     block_size == 4096 ? fn(4096, __VA_ARGS__) : \
+     fn(block_size, __VA_ARGS__))
+
+#define ALWAYS_INLINE static inline __attribute__((always_inline))
+
+/*
+ * The AVX2 versions of the bitmap and block scans are built whatever the
+ * compiler flags, and used only when the CPU running the tool has AVX2.
+ * SSE2 is part of x86-64, so its versions are used as they are.
+ */
+#if defined(__x86_64__) || defined(__i386__)
+#define HAVE_AVX2_PATH 1
+#define TARGET_AVX2 __attribute__((target("avx2")))
+
+// Whether the CPU can run the TARGET_AVX2 functions
+static int cpu_has_avx2() {
+    static int has = -1;
+    if (has == -1) {
+        has = __builtin_cpu_supports("avx2") != 0;
+    }
+    return has;
+}
+#endif
+
+size_t block_size;
+int pointers_per_block;
+
+// Size of the mapping made by open_image
+static size_t image_size;
+
+// Per group, the inode and block bitmap indexes below which every bit is
+// known to be set: the searches start there, so a process allocating many
+// times does not rescan the full start of a group each time.
+static int *first_free_inode;
+static int *first_free_block;
+
+// Dirty log of the image, opened on the first record; no records are made
+// when dirty_log_name is NULL or for a private mapping
+static char *dirty_log_name;
+static int dirty_log = -1;
+static int dirty_log_off;
+// Records not written to the log yet, written by sync_changes
+static char *dirty_records;
+static size_t dirty_records_length;
+static size_t dirty_records_capacity;
+
+// Blocks changed since the last sync_changes, one bitmap per CHANGE_* kind,
+// made on the first change
+static uint64_t *changed_blocks[2];
+
+// Open the image file and map all of it into disk
+int open_image(char *path, int access) {
+    int fd = open(path, (access & IMAGE_PRIVATE) ? O_RDONLY : O_RDWR);
+    if (fd == -1) {
+        perror("open");
+        exit(1);
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        perror("fstat");
+        exit(1);
+    }
+    // the super block alone ends at 2048
+    if (st.st_size < 2048) {
+        fprintf(stderr, "Image file is too small\n");
+        exit(1);
+    }
+
+    disk = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE,
+                (access & IMAGE_PRIVATE) ? MAP_PRIVATE : MAP_SHARED, fd, 0);
+    if (disk == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+
+    image_size = st.st_size;
+
+    struct ext2_super_block *sb = get_super_block();
+    block_size = EXT2_MIN_BLOCK_SIZE << sb->s_log_block_size;
+    pointers_per_block = block_size / sizeof(unsigned int);
+    if ((off_t)sb->s_blocks_count * block_size > st.st_size) {
+        fprintf(stderr, "Image file is smaller than the file system in it\n");
+        exit(1);
+    }
+    first_free_inode = calloc(get_group_count(), sizeof(int));
+    first_free_block = calloc(get_group_count(), sizeof(int));
+    if (first_free_inode == NULL || first_free_block == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+
+    // the log sits next to the image; a private mapping changes nothing in it
+    dirty_log_name = malloc(strlen(path) + sizeof(".dirty"));
+    if (dirty_log_name == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    sprintf(dirty_log_name, "%s.dirty", path);
+    dirty_log_off = (access & (IMAGE_PRIVATE | IMAGE_UNLOGGED)) != 0;
+
+    // The hints are only advisory, so failures are ignored
+    if (access & IMAGE_SEQUENTIAL) {
+        madvise(disk, st.st_size, MADV_SEQUENTIAL);
+    } else {
+        madvise(disk, st.st_size, MADV_RANDOM);
+    }
+#ifdef MADV_HUGEPAGE
+    madvise(disk, st.st_size, MADV_HUGEPAGE);
+#endif
+    return fd;
+}
+
+// Write the whole mapping back to the image file
+void sync_image() {
+    if (msync(disk, image_size, MS_SYNC) == -1) {
+        perror("msync");
+    }
+}
+
+// Write back the pages of the mapping holding length bytes from start
+void sync_region(void *start, size_t length) {
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t from = ((unsigned char*)start - disk) / page * page;
+    size_t to = (unsigned char*)start - disk + length;
+    if (to > image_size) {
+        to = image_size;
+    }
+    if (from < to && msync(disk + from, to - from, MS_SYNC) == -1) {
+        perror("msync");
+    }
+}
+
+// Note the blocks holding the bytes as changed
+void mark_changed(const void *start, size_t length, int kind) {
+    size_t blocks = image_size / block_size;
+    if (changed_blocks[kind] == NULL) {
+        changed_blocks[kind] = calloc((blocks + 63) / 64, sizeof(uint64_t));
+        if (changed_blocks[kind] == NULL) {
+            perror("calloc");
+            exit(1);
+        }
+    }
+    size_t first = ((const unsigned char*)start - disk) / block_size;
+    size_t last = ((const unsigned char*)start - disk + (length > 0 ? length - 1 : 0)) / block_size;
+    for (size_t b = first; b <= last && b < blocks; b++) {
+        changed_blocks[kind][b / 64] |= 1ULL << (b % 64);
+    }
+}
+
 /**
- * Find the last non-zero entry in the i_block.
- * Helper function for create_directory (mkdir).
+ * Write back the changed blocks of the bitmap, as page ranges in block
+ * order, merging the runs that share or touch a page, then clear it.
+ * Helper function for sync_changes.
  */
-static int find_last_nonzero(unsigned int *i_block) {
-    //The fisr entry should never be 0!
-    assert(i_block[0] != 0);
-    for (int i = 1; i < 15; i++) {
-        if (i_block[i] == 0) {
-            return i-1;
+static void sync_changed_blocks(uint64_t *changed) {
+    if (changed == NULL) {
+        return;
+    }
+    int blocks = image_size / block_size;
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t from = 0;
+    size_t to = 0;
+    int block = find_next_bit((unsigned char*)changed, 0, blocks, 1);
+    while (block != -1) {
+        int end = find_next_bit((unsigned char*)changed, block, blocks, 0);
+        if (end == -1) {
+            end = blocks;
         }
+        size_t start = (size_t)block * block_size / page * page;
+        size_t stop = (size_t)end * block_size;
+        if (start > to) {
+            if (from < to && msync(disk + from, to - from, MS_SYNC) == -1) {
+                perror("msync");
+            }
+            from = start;
+        }
+        to = stop;
+        block = find_next_bit((unsigned char*)changed, end, blocks, 1);
     }
-    return -1;
+    if (from < to && msync(disk + from, to - from, MS_SYNC) == -1) {
+        perror("msync");
+    }
+    memset(changed, 0, (blocks + 63) / 64 * sizeof(uint64_t));
 }
 
 /**
- * Find the last non-zero entry in a 1024 length array. 
- * Helper function for create_directory (mkdir).
- */ 
-static int find_last_nonzero_1024(unsigned int* arr) {
-    assert(arr[0] != 0);
-    for (int i = 1; i < 1024 - 1; i++) {
-        if (arr[i] == 0) {
-            return i -1;
+ * Write the records made since the last call to the dirty log, all at once.
+ * Return 0 on success, -1 with errno set on failure.
+ * Helper function for sync_dirty_log and sync_changes.
+ */
+static int write_dirty_records() {
+    size_t done = 0;
+    while (done < dirty_records_length) {
+        ssize_t n = write(dirty_log, dirty_records + done, dirty_records_length - done);
+        if (n == -1) {
+            return -1;
+        }
+        done += n;
+    }
+    dirty_records_length = 0;
+    return 0;
+}
+
+// Write the records left when a tool exits without sync_changes, on error
+static void write_dirty_records_at_exit() {
+    if (write_dirty_records() == -1) {
+        perror("write");
+    }
+}
+
+/**
+ * Make the dirty log durable: it is written ahead, and reaches the disk
+ * before what it names. Helper function for sync_changes and
+ * relocate_inode_blocks.
+ */
+static void sync_dirty_log() {
+    if (write_dirty_records() == -1) {
+        perror("write");
+        exit(1);
+    }
+    if (dirty_log != -1 && fsync(dirty_log) == -1) {
+        perror("fsync");
+        exit(1);
+    }
+}
+
+// Write back what changed, as EXT2_SYNC says
+void sync_changes() {
+    char *mode = getenv("EXT2_SYNC");
+    if (mode == NULL || strcmp(mode, "none") != 0) {
+        sync_dirty_log();
+    } else if (write_dirty_records() == -1) {
+        perror("write");
+        exit(1);
+    }
+    if (mode != NULL && strcmp(mode, "metadata") == 0) {
+        sync_changed_blocks(changed_blocks[CHANGE_METADATA]);
+    } else if (mode == NULL || strcmp(mode, "none") != 0) {
+        // an unknown mode is taken as the safest one
+        if (mode != NULL && strcmp(mode, "all") != 0) {
+            fprintf(stderr, "EXT2_SYNC must be none, metadata or all, all is used\n");
+        }
+        sync_changed_blocks(changed_blocks[CHANGE_DATA]);
+        sync_changed_blocks(changed_blocks[CHANGE_METADATA]);
+    }
+}
+
+// Append a record to the dirty log, opening it the first time
+void log_dirty(char kind, unsigned int number, int count) {
+    if (dirty_log_name == NULL || dirty_log_off) {
+        return;
+    }
+    // a change the log misses would go unchecked by --incremental, so the
+    // operation stops before making it
+    if (dirty_log == -1) {
+        dirty_log = open(dirty_log_name, O_WRONLY | O_CREAT | O_APPEND, 0644);
+        if (dirty_log == -1) {
+            perror("open");
+            exit(1);
+        }
+        atexit(write_dirty_records_at_exit);
+    }
+    // kept until sync_changes writes them, before the image, with one
+    // write for all the changes of the operations since the last one
+    if (dirty_records_capacity - dirty_records_length < 32) {
+        dirty_records_capacity = dirty_records_capacity == 0 ? 4096 : dirty_records_capacity * 2;
+        dirty_records = realloc(dirty_records, dirty_records_capacity);
+        if (dirty_records == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    dirty_records_length += snprintf(dirty_records + dirty_records_length, 32, "%c %u %d\n",
+                                     kind, number, count);
+}
+
+// Read every record of the dirty log
+int read_dirty_log(struct dirty_record **records) {
+    *records = NULL;
+    FILE *log = fopen(dirty_log_name, "r");
+    if (log == NULL) {
+        return 0;
+    }
+    int record_count = 0;
+    int capacity = 0;
+    struct dirty_record record;
+    while (fscanf(log, " %c %u %d", &record.kind, &record.number, &record.count) == 3) {
+        if (record_count == capacity) {
+            capacity = capacity == 0 ? 64 : capacity * 2;
+            *records = realloc(*records, sizeof(struct dirty_record) * capacity);
+            if (*records == NULL) {
+                perror("realloc");
+                exit(1);
+            }
+        }
+        (*records)[record_count++] = record;
+    }
+    fclose(log);
+    return record_count;
+}
+
+// Drop the dirty log, and what was about to be added to it
+void clear_dirty_log() {
+    dirty_records_length = 0;
+    if (dirty_log != -1) {
+        close(dirty_log);
+        dirty_log = -1;
+    }
+    if (unlink(dirty_log_name) == -1 && errno != ENOENT) {
+        perror("unlink");
+    }
+}
+
+// Return a pointer to the super block of the image
+struct ext2_super_block* get_super_block() {
+    return (struct ext2_super_block*)(disk + EXT2_SUPER_BLOCK_OFFSET);
+}
+
+// Return the number of block groups in the image
+int get_group_count() {
+    struct ext2_super_block *sb = get_super_block();
+    return (sb->s_blocks_count - sb->s_first_data_block + sb->s_blocks_per_group - 1)
+        / sb->s_blocks_per_group;
+}
+
+// Return a pointer to the descriptor of the given block group
+struct ext2_group_desc* get_group_desc(int group) {
+    struct ext2_super_block *sb = get_super_block();
+    // the descriptor table starts in the block right after the super block,
+    // which is block 1 for 1 KiB blocks and block 0 for larger ones
+    struct ext2_group_desc *table = (struct ext2_group_desc*)
+        (disk + block_size * (sb->s_first_data_block + 1));
+    return table + group;
+}
+
+// Return a pointer to the inode with the given inode number
+struct ext2_inode* get_inode(int inode) {
+    struct ext2_super_block *sb = get_super_block();
+    int inode_size = sb->s_rev_level == 0 ? 128 : sb->s_inode_size;
+    int group = (inode - 1) / sb->s_inodes_per_group;
+    int index = (inode - 1) % sb->s_inodes_per_group;
+    unsigned char *table = disk + block_size * get_group_desc(group)->bg_inode_table;
+    return (struct ext2_inode*)(table + inode_size * index);
+}
+
+// Return the block group of the inode with the given inode number
+int inode_group(int inode) {
+    return (inode - 1) / get_super_block()->s_inodes_per_group;
+}
+
+// Return the block group of the given block
+int block_group(int block) {
+    struct ext2_super_block *sb = get_super_block();
+    return (block - sb->s_first_data_block) / sb->s_blocks_per_group;
+}
+
+/**
+ * Return the bitmap byte holding the bit of the given inode and set bit to
+ * the position of the inode in that byte.
+ */
+static unsigned char* inode_bitmap_byte(int inode, int *bit) {
+    struct ext2_super_block *sb = get_super_block();
+    struct ext2_group_desc *gd = get_group_desc(inode_group(inode));
+    int index = (inode - 1) % sb->s_inodes_per_group;
+    *bit = index % 8;
+    return disk + block_size * gd->bg_inode_bitmap + index / 8;
+}
+
+/**
+ * Return the bitmap byte holding the bit of the given block and set bit to
+ * the position of the block in that byte.
+ */
+static unsigned char* block_bitmap_byte(int block, int *bit) {
+    struct ext2_super_block *sb = get_super_block();
+    struct ext2_group_desc *gd = get_group_desc(block_group(block));
+    int index = (block - sb->s_first_data_block) % sb->s_blocks_per_group;
+    *bit = index % 8;
+    return disk + block_size * gd->bg_block_bitmap + index / 8;
+}
+
+// Check whether the inode is in use in the inode bitmap
+int inode_in_use(int inode) {
+    int bit;
+    unsigned char *byte = inode_bitmap_byte(inode, &bit);
+    return (*byte >> bit) & 1;
+}
+
+// Check whether the block is in use in the block bitmap
+int block_in_use(int block) {
+    int bit;
+    unsigned char *byte = block_bitmap_byte(block, &bit);
+    return (*byte >> bit) & 1;
+}
+
+/**
+ * Note count bits from bit first of a bitmap of the group changed, along
+ * with the free counters of the group and of the super block.
+ */
+static void mark_bits_changed(unsigned char *bitmap, int first, int count, int group) {
+    mark_changed(bitmap + first / 8, (first + count - 1) / 8 - first / 8 + 1, CHANGE_METADATA);
+    mark_changed(get_group_desc(group), sizeof(struct ext2_group_desc), CHANGE_METADATA);
+    mark_changed(get_super_block(), sizeof(struct ext2_super_block), CHANGE_METADATA);
+}
+
+// Mark the inode as in use and update the free inode counters
+int claim_inode(int inode) {
+    int bit;
+    unsigned char *byte = inode_bitmap_byte(inode, &bit);
+    if (*byte & (1 << bit)) {
+        return 0;
+    }
+    log_dirty(DIRTY_INODE, inode, 1);
+    *byte |= 1 << bit;
+    get_super_block()->s_free_inodes_count--;
+    get_group_desc(inode_group(inode))->bg_free_inodes_count--;
+    mark_bits_changed(byte, 0, 1, inode_group(inode));
+    return 1;
+}
+
+// Mark the block as in use and update the free block counters
+int claim_block(int block) {
+    int bit;
+    unsigned char *byte = block_bitmap_byte(block, &bit);
+    if (*byte & (1 << bit)) {
+        return 0;
+    }
+    log_dirty(DIRTY_BLOCKS, block, 1);
+    *byte |= 1 << bit;
+    get_super_block()->s_free_blocks_count--;
+    get_group_desc(block_group(block))->bg_free_blocks_count--;
+    mark_bits_changed(byte, 0, 1, block_group(block));
+    return 1;
+}
+
+// Note that bit index of the group's bitmap may be free again
+static void lower_first_free(int *first_free, int group, int index) {
+    if (first_free[group] > index) {
+        first_free[group] = index;
+    }
+}
+
+// Mark the inode as free and update the free inode counters
+void release_inode(int inode) {
+    int bit;
+    unsigned char *byte = inode_bitmap_byte(inode, &bit);
+    if (*byte & (1 << bit)) {
+        log_dirty(DIRTY_INODE, inode, 1);
+        *byte &= ~(1 << bit);
+        get_super_block()->s_free_inodes_count++;
+        get_group_desc(inode_group(inode))->bg_free_inodes_count++;
+        lower_first_free(first_free_inode, inode_group(inode),
+                         (inode - 1) % get_super_block()->s_inodes_per_group);
+        mark_bits_changed(byte, 0, 1, inode_group(inode));
+    }
+}
+
+// Mark the block as free and update the free block counters
+void release_block(int block) {
+    int bit;
+    unsigned char *byte = block_bitmap_byte(block, &bit);
+    if (*byte & (1 << bit)) {
+        log_dirty(DIRTY_BLOCKS, block, 1);
+        *byte &= ~(1 << bit);
+        get_super_block()->s_free_blocks_count++;
+        get_group_desc(block_group(block))->bg_free_blocks_count++;
+        lower_first_free(first_free_block, block_group(block),
+                         block - group_first_block(block_group(block)));
+        mark_bits_changed(byte, 0, 1, block_group(block));
+    }
+}
+
+
+// Return the size of the file of the inode
+unsigned long long get_inode_size(struct ext2_inode *inode) {
+    unsigned long long size = inode->i_size;
+    // regular files keep the high 32 bits of the size in i_dir_acl
+    if ((inode->i_mode & 0xF000) == EXT2_S_IFREG) {
+        size |= (unsigned long long)inode->i_dir_acl << 32;
+    }
+    return size;
+}
+
+// Set the size of the file of the inode
+void set_inode_size(struct ext2_inode *inode, unsigned long long size) {
+    mark_changed(inode, sizeof(struct ext2_inode), CHANGE_METADATA);
+    inode->i_size = size & 0xFFFFFFFF;
+    if ((inode->i_mode & 0xF000) == EXT2_S_IFREG) {
+        inode->i_dir_acl = size >> 32;
+        // files of 2 GiB or more need the large file feature
+        if (size > 0x7FFFFFFF) {
+            get_super_block()->s_feature_ro_compat |= EXT2_FEATURE_RO_COMPAT_LARGE_FILE;
+        }
+    }
+}
+
+/**
+ * Find where logical block `logical` of a file is recorded: offsets[0] is the
+ * index in i_block, offsets[1..] the index in each level of indirect block.
+ * Return the number of offsets filled (1 for a direct block, 4 for a block
+ * under the triple indirect block), or 0 if the logical block is beyond what
+ * the triple indirect block can map.
+ */
+static int block_to_path(unsigned int logical, int offsets[4]) {
+    unsigned long long n = logical;
+    unsigned long long p = pointers_per_block;
+    if (n < EXT2_NDIR_BLOCKS) {
+        offsets[0] = n;
+        return 1;
+    }
+    n -= EXT2_NDIR_BLOCKS;
+    if (n < p) {
+        offsets[0] = EXT2_IND_BLOCK;
+        offsets[1] = n;
+        return 2;
+    }
+    n -= p;
+    if (n < p * p) {
+        offsets[0] = EXT2_DIND_BLOCK;
+        offsets[1] = n / p;
+        offsets[2] = n % p;
+        return 3;
+    }
+    n -= p * p;
+    if (n < p * p * p) {
+        offsets[0] = EXT2_TIND_BLOCK;
+        offsets[1] = n / (p * p);
+        offsets[2] = (n / p) % p;
+        offsets[3] = n % p;
+        return 4;
+    }
+    return 0;
+}
+
+// Return the block holding the logical block of the inode
+unsigned int get_inode_block(struct ext2_inode *inode, unsigned int logical) {
+    int offsets[4];
+    int depth = block_to_path(logical, offsets);
+    if (depth == 0) {
+        return 0;
+    }
+    unsigned int block = inode->i_block[offsets[0]];
+    for (int k = 1; k < depth && block != 0; k++) {
+        unsigned int *table = (unsigned int*)(disk + block_size * block);
+        block = table[offsets[k]];
+    }
+    return block;
+}
+
+// Take the next block from the pool
+int take_block(struct block_pool *pool) {
+    int block;
+    if (pool->run < pool->run_count) {
+        block = pool->runs[pool->run].start + pool->offset;
+        pool->offset++;
+        if (pool->offset == pool->runs[pool->run].count) {
+            pool->run++;
+            pool->offset = 0;
+        }
+    } else {
+        block = allocate_block_near(pool->goal);
+        if (block == ERR_NO_BLOCK) {
+            return ERR_NO_BLOCK;
+        }
+    }
+    pool->goal = block + 1;
+    return block;
+}
+
+// Map the logical block of the inode to a new block taken from the pool
+/**
+ * Map the logical block of the inode as map_new_block does, marking the
+ * indirect blocks changed but not the inode, which may be a copy outside
+ * the mapping. Helper function for map_new_block and relocate_inode_blocks.
+ */
+static int map_block(struct ext2_inode *inode, unsigned int logical, struct block_pool *pool) {
+    int offsets[4];
+    int depth = block_to_path(logical, offsets);
+    if (depth == 0) {
+        return ERR_NO_BLOCK;
+    }
+
+    // walk down the indirect blocks, creating the missing ones on the way
+    unsigned int *slot = &inode->i_block[offsets[0]];
+    for (int k = 1; k < depth; k++) {
+        if (*slot == 0) {
+            int new_indirect = take_block(pool);
+            if (new_indirect == ERR_NO_BLOCK) {
+                return ERR_NO_BLOCK;
+            }
+            memset(disk + block_size * new_indirect, 0, block_size);
+            mark_changed(disk + block_size * new_indirect, block_size, CHANGE_METADATA);
+            *slot = new_indirect;
+            // a slot of i_block is left to the caller
+            if (k > 1) {
+                mark_changed(slot, sizeof(unsigned int), CHANGE_METADATA);
+            }
+            inode->i_blocks += block_size / 512;
+        }
+        unsigned int *table = (unsigned int*)(disk + block_size * *slot);
+        slot = &table[offsets[k]];
+    }
+
+    int new_block = take_block(pool);
+    if (new_block == ERR_NO_BLOCK) {
+        return ERR_NO_BLOCK;
+    }
+    *slot = new_block;
+    if (depth > 1) {
+        mark_changed(slot, sizeof(unsigned int), CHANGE_METADATA);
+    }
+    inode->i_blocks += block_size / 512;
+    return new_block;
+}
+
+int map_new_block(struct ext2_inode *inode, unsigned int logical, struct block_pool *pool) {
+    int new_block = map_block(inode, logical, pool);
+    mark_changed(inode, sizeof(struct ext2_inode), CHANGE_METADATA);
+    return new_block;
+}
+
+// Count the indirect blocks a file of data_blocks blocks without holes needs
+int count_indirect_blocks(unsigned int data_blocks) {
+    unsigned long long n = data_blocks;
+    unsigned long long p = pointers_per_block;
+    int count = 0;
+    if (n <= EXT2_NDIR_BLOCKS) {
+        return 0;
+    }
+    n -= EXT2_NDIR_BLOCKS;
+
+    // single indirect
+    count++;
+    if (n <= p) {
+        return count;
+    }
+    n -= p;
+
+    // double indirect and the single indirect blocks under it
+    unsigned long long under = n < p * p ? n : p * p;
+    count += 1 + (under + p - 1) / p;
+    if (n <= p * p) {
+        return count;
+    }
+    n -= p * p;
+
+    // triple indirect, then its double and single indirect blocks
+    count += 1 + (n + p * p - 1) / (p * p) + (n + p - 1) / p;
+    return count;
+}
+
+// Count the indirect blocks logical needs that previous did not
+int count_new_indirect_blocks(long long previous, unsigned int logical) {
+    int offsets[4], previous_offsets[4];
+    int depth = block_to_path(logical, offsets);
+    int previous_depth = previous < 0 ? 0 : block_to_path(previous, previous_offsets);
+    int count = 0;
+    int shared = previous_depth == depth;
+    for (int k = 1; k < depth; k++) {
+        // the indirect block at level k is shared as long as the path to it is
+        shared = shared && offsets[k - 1] == previous_offsets[k - 1];
+        if (!shared) {
+            count++;
+        }
+    }
+    return count;
+}
+
+// Start iterating over the blocks of the inode
+void block_iter_init(struct block_iter *it, struct ext2_inode *inode, int flags) {
+    memset(it, 0, sizeof(struct block_iter));
+    it->inode = inode;
+    it->all = flags & BLOCK_ITER_ALL;
+    // a fast symlink keeps its target in i_block instead of block numbers
+    if ((inode->i_mode & 0xF000) == EXT2_S_IFLNK && inode->i_blocks == 0) {
+        return;
+    }
+    unsigned long long end = (get_inode_size(inode) + block_size - 1) / block_size;
+    it->end = end > 0xFFFFFFFF ? 0xFFFFFFFF : end;
+}
+
+/**
+ * Find the block pointer array holding logical block it->next: i_block for
+ * a direct block, or the last level indirect block on its path. Indirect
+ * blocks that are not allocated (or point outside the file system) make
+ * holes, skipped here as a whole. In BLOCK_ITER_ALL mode, stop at the first
+ * indirect block entered for the first time on the way down and set
+ * it->meta to it instead, leaving it->table unset.
+ * Return 1 if the table (or it->meta) is found, 0 at the end of the file.
+ * Helper function for next_piece.
+ */
+static int locate_table(struct block_iter *it) {
+    unsigned int blocks_count = get_super_block()->s_blocks_count;
+    unsigned long long p = pointers_per_block;
+    while (it->next < it->end) {
+        int offsets[4];
+        int depth = block_to_path(it->next, offsets);
+        if (depth == 0) {
+            it->next = it->end;
+            return 0;
+        }
+        unsigned int *table = it->inode->i_block;
+        int k;
+        for (k = 1; k < depth; k++) {
+            unsigned int block = table[offsets[k - 1]];
+            if (block == 0 || block >= blocks_count) {
+                break;
+            }
+            if (it->all && it->seen[k] != block) {
+                // return it alone, the next call goes on down the path
+                it->seen[k] = block;
+                it->meta = block;
+                return 1;
+            }
+            table = (unsigned int*)(disk + block_size * block);
+        }
+        if (k == depth) {
+            it->table = table;
+            it->index = offsets[depth - 1];
+            it->table_len = depth == 1 ? EXT2_NDIR_BLOCKS : pointers_per_block;
+            return 1;
+        }
+
+        // the pointer at level k is missing: skip everything it would map,
+        // that is the rest of a subtree of p^(depth - k) blocks
+        unsigned long long span = 1;
+        unsigned long long position = 0;
+        for (int j = depth - 1; j >= k; j--) {
+            position += offsets[j] * span;
+            span *= p;
+        }
+        unsigned long long next = it->next + span - position;
+        it->next = next > it->end ? it->end : next;
+    }
+    return 0;
+}
+
+/**
+ * Produce the next piece of the iteration: an indirect block met for the
+ * first time (BLOCK_ITER_ALL only), or a run of contiguous data blocks in
+ * one block pointer array. Return the number of blocks, 0 at the end.
+ * Helper function for block_iter_next.
+ */
+static int next_piece(struct block_iter *it, unsigned int *logical, unsigned int *block) {
+    unsigned int blocks_count = get_super_block()->s_blocks_count;
+    while (1) {
+        if (it->table == NULL && !locate_table(it)) {
+            return 0;
+        }
+        if (it->meta != 0) {
+            // it->table is still unset, the path is located again next time
+            *logical = it->next;
+            *block = it->meta;
+            it->meta = 0;
+            return 1;
+        }
+
+        // skip the holes in this table
+        unsigned int *table = it->table;
+        while (it->index < it->table_len && it->next < it->end &&
+               (table[it->index] == 0 || table[it->index] >= blocks_count)) {
+            it->index++;
+            it->next++;
+        }
+        if (it->index < it->table_len && it->next < it->end) {
+            unsigned int start = table[it->index];
+            int count = 1;
+            while (it->index + count < it->table_len && it->next + count < it->end &&
+                   table[it->index + count] == start + count) {
+                count++;
+            }
+            *logical = it->next;
+            *block = start;
+            it->index += count;
+            it->next += count;
+            if (it->index == it->table_len) {
+                it->table = NULL;
+            }
+            return count;
+        }
+        it->table = NULL;
+        if (it->next >= it->end) {
+            return 0;
+        }
+    }
+}
+
+// Return the next run of blocks of the inode
+int block_iter_next(struct block_iter *it, unsigned int *logical, unsigned int *block) {
+    int count;
+    if (it->pending_count > 0) {
+        *logical = it->pending_logical;
+        *block = it->pending_block;
+        count = it->pending_count;
+        it->pending_count = 0;
+    } else {
+        count = next_piece(it, logical, block);
+        if (count == 0) {
+            return 0;
+        }
+    }
+
+    // merge the following pieces while they carry on the run on disk (and
+    // in the file, unless the indirect blocks are wanted too)
+    unsigned int piece_logical, piece_block;
+    int piece_count;
+    while ((piece_count = next_piece(it, &piece_logical, &piece_block)) > 0) {
+        if (piece_block == *block + count &&
+            (it->all || piece_logical == *logical + count)) {
+            count += piece_count;
+        } else {
+            it->pending_logical = piece_logical;
+            it->pending_block = piece_block;
+            it->pending_count = piece_count;
+            break;
+        }
+    }
+    return count;
+}
+
+// Release every block used by the inode
+void release_inode_blocks(struct ext2_inode *inode) {
+    struct block_iter it;
+    unsigned int logical, block;
+    int count;
+    block_iter_init(&it, inode, BLOCK_ITER_ALL);
+    while ((count = block_iter_next(&it, &logical, &block)) > 0) {
+        release_blocks(block, count);
+    }
+}
+
+/**
+ * Release the block, and the blocks it maps down level levels of indirect
+ * blocks (0 for a data block). Return the number of blocks released.
+ * Helper function for truncate_inode_blocks.
+ */
+static int release_tree(unsigned int block, int level) {
+    int released = 0;
+    if (level > 0) {
+        unsigned int *table = (unsigned int*)(disk + block_size * block);
+        for (int i = 0; i < pointers_per_block; i++) {
+            if (table[i] != 0) {
+                released += release_tree(table[i], level - 1);
+            }
+        }
+    }
+    release_block(block);
+    return released + 1;
+}
+
+/**
+ * Release what the pointer at entry maps of the logical blocks from keep
+ * on, the pointer mapping the logical blocks from base through level levels
+ * of indirect blocks, and clear the pointers to the released blocks.
+ * Return the number of blocks released.
+ * Helper function for truncate_inode_blocks.
+ */
+static int truncate_tree(unsigned int *entry, int level, unsigned long long base,
+                         unsigned long long keep) {
+    if (*entry == 0) {
+        return 0;
+    }
+    if (base >= keep) {
+        int released = release_tree(*entry, level);
+        *entry = 0;
+        mark_changed(entry, sizeof(unsigned int), CHANGE_METADATA);
+        return released;
+    }
+    if (level == 0) {
+        return 0;
+    }
+    unsigned long long span = 1;
+    for (int l = 1; l < level; l++) {
+        span *= pointers_per_block;
+    }
+    // the pointers mapping only kept blocks are left alone
+    unsigned int *table = (unsigned int*)(disk + block_size * *entry);
+    int released = 0;
+    for (int i = (keep - base) / span; i < pointers_per_block; i++) {
+        released += truncate_tree(&table[i], level - 1, base + i * span, keep);
+    }
+    return released;
+}
+
+// Release the blocks of the inode from logical block keep on
+void truncate_inode_blocks(struct ext2_inode *inode, unsigned int keep) {
+    unsigned long long p = pointers_per_block;
+    unsigned long long base[] = { EXT2_NDIR_BLOCKS, EXT2_NDIR_BLOCKS + p,
+                                  EXT2_NDIR_BLOCKS + p + p * p };
+    int released = 0;
+    for (int i = 0; i < EXT2_NDIR_BLOCKS; i++) {
+        released += truncate_tree(&inode->i_block[i], 0, i, keep);
+    }
+    for (int level = 1; level <= 3; level++) {
+        released += truncate_tree(&inode->i_block[EXT2_NDIR_BLOCKS + level - 1], level,
+                                  base[level - 1], keep);
+    }
+    inode->i_blocks -= released * (block_size / 512);
+    mark_changed(inode, sizeof(struct ext2_inode), CHANGE_METADATA);
+}
+
+// Count the runs of contiguous blocks the blocks of the inode make
+int count_fragments(struct ext2_inode *inode) {
+    struct block_iter it;
+    unsigned int logical, block;
+    int fragments = 0;
+    block_iter_init(&it, inode, BLOCK_ITER_ALL);
+    while (block_iter_next(&it, &logical, &block) > 0) {
+        fragments++;
+    }
+    return fragments;
+}
+
+// Move the blocks of the inode to one run of free blocks
+int relocate_inode_blocks(struct ext2_inode *inode, int goal) {
+    // the data blocks, and the indirect blocks needed to map them
+    int total = 0;
+    long long previous = -1;
+    struct block_iter it;
+    unsigned int logical, block;
+    int count;
+    block_iter_init(&it, inode, BLOCK_ITER_DATA);
+    while ((count = block_iter_next(&it, &logical, &block)) > 0) {
+        for (int i = 0; i < count; i++) {
+            total += 1 + count_new_indirect_blocks(previous, logical + i);
+            previous = logical + i;
         }
     }
-    return 1023;
+    struct block_run run = { .start = find_free_run(goal, total), .count = total };
+    if ((int)run.start == ERR_NO_BLOCK) {
+        return ERR_NO_BLOCK;
+    }
+    claim_blocks(run.start, total);
+
+    // copy: build the new block map on a copy of the inode, each indirect
+    // block before the data it maps as map_new_block lays them out; the
+    // copy is not in the mapping, the inode is marked when it switches
+    struct ext2_inode copy = *inode;
+    memset(copy.i_block, 0, sizeof(copy.i_block));
+    copy.i_blocks = 0;
+    struct block_pool pool = { .runs = &run, .run_count = 1 };
+    block_iter_init(&it, inode, BLOCK_ITER_DATA);
+    while ((count = block_iter_next(&it, &logical, &block)) > 0) {
+        for (int i = 0; i < count; i++) {
+            int new_block = map_block(&copy, logical + i, &pool);
+            memcpy(disk + block_size * new_block, disk + block_size * (block + i), block_size);
+            mark_changed(disk + block_size * new_block, block_size, CHANGE_DATA);
+        }
+    }
+
+    // the new blocks and the bitmaps reach the disk before the inode points
+    // to them, so a crash leaves either the old blocks or the new ones in
+    // use, and at worst some blocks marked used that nothing points to;
+    // only what changed since the last file moved is written back, but
+    // whatever EXT2_SYNC says, as the inode is written back next
+    sync_dirty_log();
+    sync_changed_blocks(changed_blocks[CHANGE_DATA]);
+    sync_changed_blocks(changed_blocks[CHANGE_METADATA]);
+
+    // switch: the inode takes the new map, then the old blocks go
+    struct ext2_inode old = *inode;
+    memcpy(inode->i_block, copy.i_block, sizeof(inode->i_block));
+    inode->i_blocks = copy.i_blocks;
+    mark_changed(inode, sizeof(struct ext2_inode), CHANGE_METADATA);
+    sync_region(inode, sizeof(struct ext2_inode));
+    release_inode_blocks(&old);
+    return run.start;
 }
 
 
@@ -116,6 +1075,10 @@ char** parse_path(char *path, int *length) {
             this_count++;
         }
     }
+    // the last token is not followed by a slash
+    if (path[str_len - 1] != '/') {
+        result[k][this_count] = '\0';
+    }
     for (int i = 0; i < count; i++) {
         if (strlen(result[i]) > 255) {
             return NULL;
@@ -126,157 +1089,726 @@ char** parse_path(char *path, int *length) {
     
 }
 
-// Trace the path to find the target directory
-int trace_path(char** path, int length) {
-    struct ext2_group_desc *bd = (struct ext2_group_desc*)(disk + (EXT2_BLOCK_SIZE) * 2);
-    struct ext2_inode *inodes = (struct ext2_inode*)
-            (disk + EXT2_BLOCK_SIZE * bd->bg_inode_table);
-    struct ext2_inode root_inode = inodes[EXT2_ROOT_INO - 1];
-    if (length == 1) {
-        return EXT2_ROOT_INO;
+// Free the array returned by parse_path
+void free_path(char **path, int length) {
+    for (int i = 0; i < length; i++) {
+        free(path[i]);
+    }
+    free(path);
+}
+
+// Trace the path to find the target directory
+int trace_path(char** path, int length) {
+    int cur_inode = EXT2_ROOT_INO;
+    for (int i = 1; i < length; i++) {
+        int result = find_in_inode(cur_inode, path[i], 'd');
+        if (result <= 0) {
+            return -ENOENT;
+        }
+        cur_inode = result;
+    }
+    return cur_inode;
+}
+
+
+/**
+ * Find the entry with name in a block of bsize bytes, skipping deleted
+ * entries and entries of unknown type. Set *type to its type ('f', 'd' or
+ * 'l') and return its inode, or return ERR_NOT_EXIST.
+ */
+ALWAYS_INLINE int lookup_in_block_sized(const size_t bsize, int block, char* name, char *type) {
+    unsigned char *this_block = disk + bsize * block;
+    struct ext2_dir_entry *this_dir = (struct ext2_dir_entry*)this_block;
+    int name_len = strlen(name);
+    int size = 0;
+
+    while (size < bsize) {
+        size += this_dir->rec_len;
+        char this_type = 0;
+        if (this_dir->file_type == EXT2_FT_SYMLINK) {
+            this_type = 'l';
+        } else if (this_dir->file_type == EXT2_FT_REG_FILE) {
+            this_type = 'f';
+        } else if (this_dir->file_type == EXT2_FT_DIR) {
+            this_type = 'd';
+        }
+
+        // compare the name of an entry with the name given,
+        // skipping deleted entries and entries of unknown type
+        if (this_type != 0 && this_dir->inode != 0 && this_dir->name_len == name_len
+            && memcmp(this_dir->name, name, name_len) == 0) {
+            *type = this_type;
+            return this_dir->inode;
+        }
+        this_dir = (struct ext2_dir_entry*)(this_block + size);
+    }
+    return ERR_NOT_EXIST;
+}
+
+int lookup_in_block(int block, char* name, char *type) {
+    return WITH_BLOCK_SIZE(lookup_in_block_sized, block, name, type);
+}
+
+// find the directory entry with name and given type in the given block
+
+int find_in_block(int block, char* name, char type) {
+    char found_type;
+    int result = lookup_in_block(block, name, &found_type);
+    if (result == ERR_NOT_EXIST || found_type == type) {
+        return result;
+    }
+    return ERR_WRONG_TYPE;
+}
+
+
+/**
+ * Cache of the directory lookups: (directory inode, name) to the inode and
+ * type of the entry, or to no entry at all (inode 0). It is filled by
+ * find_in_inode, and every function here that adds, removes or restores an
+ * entry drops the entry for that name.
+ */
+#define DENTRY_BUCKETS 16384
+#define DENTRY_MAX 65536
+
+struct dentry {
+    int parent;
+    int inode;
+    char type;
+    unsigned char name_len;
+    struct dentry *next;
+    char name[];
+};
+
+static struct dentry *dentry_table[DENTRY_BUCKETS];
+static int dentry_count;
+
+/**
+ * Return the link pointing to the cached entry for (parent, name), which
+ * points to NULL if there is none. Helper function for the dentry cache.
+ */
+static struct dentry** dentry_slot(int parent, char *name) {
+    // FNV-1a over the directory inode and the name
+    unsigned int hash = 2166136261u ^ parent;
+    int name_len = strlen(name);
+    for (int i = 0; i < name_len; i++) {
+        hash = (hash ^ (unsigned char)name[i]) * 16777619u;
+    }
+    struct dentry **slot = &dentry_table[hash % DENTRY_BUCKETS];
+    while (*slot != NULL && !((*slot)->parent == parent && (*slot)->name_len == name_len
+                              && memcmp((*slot)->name, name, name_len) == 0)) {
+        slot = &(*slot)->next;
+    }
+    return slot;
+}
+
+// Drop every cached lookup
+static void dentry_clear() {
+    for (int i = 0; i < DENTRY_BUCKETS; i++) {
+        while (dentry_table[i] != NULL) {
+            struct dentry *next = dentry_table[i]->next;
+            free(dentry_table[i]);
+            dentry_table[i] = next;
+        }
+    }
+    dentry_count = 0;
+}
+
+// Remember the result of a lookup, with inode 0 for no entry
+static void dentry_add(int parent, char *name, int inode, char type) {
+    struct dentry **slot = dentry_slot(parent, name);
+    if (*slot == NULL) {
+        // the cache is only a shortcut, start again when it is full
+        if (dentry_count == DENTRY_MAX) {
+            dentry_clear();
+            slot = dentry_slot(parent, name);
+        }
+        int name_len = strlen(name);
+        *slot = malloc(sizeof(struct dentry) + name_len);
+        if (*slot == NULL) {
+            return;
+        }
+        (*slot)->parent = parent;
+        (*slot)->name_len = name_len;
+        memcpy((*slot)->name, name, name_len);
+        (*slot)->next = NULL;
+        dentry_count++;
+    }
+    (*slot)->inode = inode;
+    (*slot)->type = type;
+}
+
+// Forget the lookup of name in the directory
+static void dentry_invalidate(int parent, char *name) {
+    struct dentry **slot = dentry_slot(parent, name);
+    if (*slot != NULL) {
+        struct dentry *old = *slot;
+        *slot = old->next;
+        free(old);
+        dentry_count--;
+    }
+}
+
+// find the directory with given name and given type in the given inode
+
+int find_in_inode(int inode, char* name, char type) {
+    char found_type = 0;
+    int result = ERR_NOT_EXIST;
+    struct dentry *cached = *dentry_slot(inode, name);
+    if (cached != NULL) {
+        result = cached->inode == 0 ? ERR_NOT_EXIST : cached->inode;
+        found_type = cached->type;
+    } else {
+        // only the leaves the name hashes to in an indexed directory,
+        // every block otherwise
+        struct htree_cursor cursor;
+        int leaf = htree_first_leaf(&cursor, inode, name);
+        if (leaf != HTREE_UNINDEXED) {
+            while (leaf != 0) {
+                result = lookup_in_block(leaf, name, &found_type);
+                if (result != ERR_NOT_EXIST) {
+                    break;
+                }
+                leaf = htree_next_leaf(&cursor);
+            }
+        } else {
+            struct block_iter it;
+            unsigned int logical, block;
+            int count;
+            block_iter_init(&it, get_inode(inode), BLOCK_ITER_DATA);
+            while (result == ERR_NOT_EXIST && (count = block_iter_next(&it, &logical, &block)) > 0) {
+                for (int i = 0; i < count && result == ERR_NOT_EXIST; i++) {
+                    result = lookup_in_block(block + i, name, &found_type);
+                }
+            }
+        }
+        dentry_add(inode, name, result == ERR_NOT_EXIST ? 0 : result, found_type);
+    }
+
+    if (result == ERR_NOT_EXIST || found_type == type) {
+        return result;
+    }
+    return ERR_WRONG_TYPE;
+}
+
+#ifdef HAVE_AVX2_PATH
+/**
+ * Skip the chunks of 4 words equal to fill from word w on, 256 bits at a
+ * time. Return the first word of the chunk that differs, or of the words
+ * left over at the end. Helper function for skip_words.
+ */
+TARGET_AVX2 static int skip_chunks_avx2(const uint64_t *words, int w, int nwords,
+                                        uint64_t fill) {
+    const __m256i pattern = _mm256_set1_epi64x(fill);
+    // the chunks are loaded unaligned: the bitmaps of the image are, but
+    // those on the heap need not be
+    while (w + 4 <= nwords) {
+        __m256i chunk = _mm256_loadu_si256((const __m256i*)(words + w));
+        __m256i diff = _mm256_xor_si256(chunk, pattern);
+        if (!_mm256_testz_si256(diff, diff)) {
+            break;
+        }
+        w += 4;
+    }
+    return w;
+}
+#endif
+
+/**
+ * Skip the words of a bitmap that are equal to fill (all ones or all zeros),
+ * starting from word w and stopping before word nwords, several words at a
+ * time when the CPU supports it. Return the index of the first word that
+ * differs from fill (or nwords). Helper function for find_next_bit.
+ */
+static int skip_words(const uint64_t *words, int w, int nwords, uint64_t fill) {
+#ifdef HAVE_AVX2_PATH
+    if (cpu_has_avx2()) {
+        w = skip_chunks_avx2(words, w, nwords, fill);
+    }
+#endif
+#if defined(__SSE2__)
+    const __m128i pattern = _mm_set1_epi64x(fill);
+    while (w + 2 <= nwords) {
+        __m128i chunk = _mm_loadu_si128((const __m128i*)(words + w));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, pattern)) != 0xFFFF) {
+            break;
+        }
+        w += 2;
+    }
+#endif
+    while (w < nwords && words[w] == fill) {
+        w++;
+    }
+    return w;
+}
+
+#ifdef HAVE_AVX2_PATH
+/**
+ * Check whether the first length / 32 * 32 bytes of data are all zero, 256
+ * bits at a time. Helper function for is_zero_block.
+ */
+TARGET_AVX2 static int zero_chunks_avx2(const unsigned char *data, size_t length) {
+    __m256i acc = _mm256_setzero_si256();
+    for (size_t i = 0; i + 32 <= length; i += 32) {
+        acc = _mm256_or_si256(acc, _mm256_loadu_si256((const __m256i*)(data + i)));
+    }
+    return _mm256_testz_si256(acc, acc);
+}
+#endif
+
+// Check whether length bytes of data are all zero
+int is_zero_block(const unsigned char *data, size_t length) {
+    size_t i = 0;
+#ifdef HAVE_AVX2_PATH
+    if (cpu_has_avx2()) {
+        if (!zero_chunks_avx2(data, length)) {
+            return 0;
+        }
+        i = length / 32 * 32;
+    }
+#endif
+#if defined(__SSE2__)
+    __m128i acc = _mm_setzero_si128();
+    for (; i + 16 <= length; i += 16) {
+        acc = _mm_or_si128(acc, _mm_loadu_si128((const __m128i*)(data + i)));
+    }
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(acc, _mm_setzero_si128())) != 0xFFFF) {
+        return 0;
+    }
+#endif
+    for (; i < length; i++) {
+        if (data[i] != 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * Find the first bit equal to value (0 or 1) in a bitmap of nbits bits,
+ * starting from bit start.
+ * The bitmap is read 64 bits at a time, so it must be 8 bytes aligned and
+ * readable up to the next multiple of 64 bits, which is always true for a
+ * bitmap block. Return the position of the bit, or -1 if there is none.
+ */
+static int find_next_bit(const unsigned char *bitmap, int start, int nbits, int value) {
+    const uint64_t *words = (const uint64_t*)bitmap;
+    // the words made only of the other value are the ones to skip
+    const uint64_t fill = value ? 0 : ~0ULL;
+    int nwords = (nbits + 63) / 64;
+    if (start >= nbits) {
+        return -1;
+    }
+
+    // flip the word so the bits we look for are ones, then ignore the ones
+    // before start
+    int w = start / 64;
+    uint64_t word = (words[w] ^ fill) & ~((1ULL << (start % 64)) - 1);
+    while (word == 0) {
+        w = skip_words(words, w + 1, nwords, fill);
+        if (w == nwords) {
+            return -1;
+        }
+        word = words[w] ^ fill;
+    }
+    int bit = w * 64 + __builtin_ctzll(word);
+    return bit < nbits ? bit : -1;
+}
+
+static int find_first_zero(const unsigned char *bitmap, int start, int nbits) {
+    return find_next_bit(bitmap, start, nbits, 0);
+}
+
+/**
+ * Set (value 1) or clear (value 0) count bits of the bitmap starting from
+ * bit start, 64 bits at a time where possible.
+ * Return the number of bits that actually changed.
+ */
+static int change_bits(unsigned char *bitmap, int start, int count, int value) {
+    int end = start + count;
+    int changed = 0;
+    while (start < end) {
+        if (start % 64 == 0 && end - start >= 64) {
+            uint64_t *word = (uint64_t*)(bitmap + start / 8);
+            uint64_t old = *word;
+            *word = value ? ~0ULL : 0;
+            changed += __builtin_popcountll(old ^ *word);
+            start += 64;
+            continue;
+        }
+        int bit = start % 8;
+        int n = 8 - bit < end - start ? 8 - bit : end - start;
+        unsigned char mask = ((1 << n) - 1) << bit;
+        unsigned char old = bitmap[start / 8];
+        bitmap[start / 8] = value ? old | mask : old & ~mask;
+        changed += __builtin_popcount(old ^ bitmap[start / 8]);
+        start += n;
+    }
+    return changed;
+}
+
+#ifdef HAVE_AVX2_PATH
+/**
+ * Count the bits set in the first nwords / 4 * 4 words, 256 bits at a time:
+ * each nibble is looked up in a table of bit counts, and the byte counts
+ * are summed into the four 64-bit lanes. Helper function for count_words.
+ */
+TARGET_AVX2 static int count_chunks_avx2(const uint64_t *words, int nwords) {
+    const __m256i table = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                           0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i low = _mm256_set1_epi8(0x0F);
+    __m256i total = _mm256_setzero_si256();
+    for (int w = 0; w + 4 <= nwords; w += 4) {
+        __m256i chunk = _mm256_loadu_si256((const __m256i*)(words + w));
+        __m256i counts = _mm256_add_epi8(
+            _mm256_shuffle_epi8(table, _mm256_and_si256(chunk, low)),
+            _mm256_shuffle_epi8(table, _mm256_and_si256(_mm256_srli_epi16(chunk, 4), low)));
+        total = _mm256_add_epi64(total, _mm256_sad_epu8(counts, _mm256_setzero_si256()));
+    }
+    return _mm256_extract_epi64(total, 0) + _mm256_extract_epi64(total, 1) +
+        _mm256_extract_epi64(total, 2) + _mm256_extract_epi64(total, 3);
+}
+#endif
+
+/**
+ * Count the bits set in nwords 64-bit words; long bitmaps go through the
+ * AVX2 version when the CPU has it. Helper function for count_bits.
+ */
+static int count_words(const uint64_t *words, int nwords) {
+    int set = 0;
+    int w = 0;
+#ifdef HAVE_AVX2_PATH
+    if (nwords >= 16 && cpu_has_avx2()) {
+        set = count_chunks_avx2(words, nwords);
+        w = nwords / 4 * 4;
+    }
+#endif
+    for (; w < nwords; w++) {
+        set += __builtin_popcountll(words[w]);
+    }
+    return set;
+}
+
+// Count the bits set among count bits of the bitmap from bit start
+int count_bits(const unsigned char *bitmap, int start, int count) {
+    int end = start + count;
+    int set = 0;
+    // byte by byte up to a whole word
+    while (start < end && start % 64 != 0) {
+        int bit = start % 8;
+        int n = 8 - bit < end - start ? 8 - bit : end - start;
+        set += __builtin_popcount(bitmap[start / 8] & (((1 << n) - 1) << bit));
+        start += n;
+    }
+    int nwords = (end - start) / 64;
+    set += count_words((const uint64_t*)(bitmap + start / 8), nwords);
+    start += nwords * 64;
+    // the bits of the last word that belong to the range
+    if (start < end) {
+        set += __builtin_popcountll(*(const uint64_t*)(bitmap + start / 8) &
+                                    ((1ULL << (end - start)) - 1));
+    }
+    return set;
+}
+
+// count the blocks belonging to a group
+int blocks_in_group(int group) {
+    struct ext2_super_block *sb = get_super_block();
+    int first_block = sb->s_first_data_block + group * sb->s_blocks_per_group;
+    int count = sb->s_blocks_count - first_block;
+    if (count > sb->s_blocks_per_group) {
+        count = sb->s_blocks_per_group;
+    }
+    return count;
+}
+
+// Return the first block of a group
+int group_first_block(int group) {
+    struct ext2_super_block *sb = get_super_block();
+    return sb->s_first_data_block + group * sb->s_blocks_per_group;
+}
+
+/**
+ * Find a free bit in the inode (is_inode) or block bitmaps, starting from
+ * bit goal_index of group goal_group and going on through the following
+ * groups, wrapping around to the start of the goal group at the end.
+ * Mark the bit and update the free counters.
+ * Return the group * bits per group + position of the bit, or -1 if every
+ * bit is set. Helper function for allocate_inode_near and allocate_block_near.
+ */
+static int allocate_near(int goal_group, int goal_index, int is_inode) {
+    struct ext2_super_block *sb = get_super_block();
+    int group_count = get_group_count();
+    int per_group = is_inode ? sb->s_inodes_per_group : sb->s_blocks_per_group;
+
+    for (int n = 0; n <= group_count; n++) {
+        int g = (goal_group + n) % group_count;
+        int start = n == 0 ? goal_index : 0;
+        // the goal group is searched again from 0 after all others
+        if (n == group_count && goal_index == 0) {
+            break;
+        }
+        struct ext2_group_desc *gd = get_group_desc(g);
+        int free_count = is_inode ? gd->bg_free_inodes_count : gd->bg_free_blocks_count;
+        if (free_count == 0) {
+            continue;
+        }
+        unsigned char *bitmap = disk + block_size *
+            (is_inode ? gd->bg_inode_bitmap : gd->bg_block_bitmap);
+        int nbits = is_inode ? sb->s_inodes_per_group : blocks_in_group(g);
+        // nothing is free below the hint, skip to it
+        int *first_free = is_inode ? first_free_inode : first_free_block;
+        int from_hint = start <= first_free[g];
+        if (from_hint) {
+            start = first_free[g];
+        }
+        int i = find_first_zero(bitmap, start, nbits);
+        if (from_hint) {
+            first_free[g] = i == -1 ? nbits : i + 1;
+        }
+        if (i != -1) {
+            if (is_inode) {
+                log_dirty(DIRTY_INODE, g * per_group + i + 1, 1);
+            } else {
+                log_dirty(DIRTY_BLOCKS, sb->s_first_data_block + g * per_group + i, 1);
+            }
+            bitmap[i / 8] |= 1 << (i % 8);
+            mark_bits_changed(bitmap, i, 1, g);
+            if (is_inode) {
+                sb->s_free_inodes_count--;
+                gd->bg_free_inodes_count--;
+            } else {
+                sb->s_free_blocks_count--;
+                gd->bg_free_blocks_count--;
+            }
+            return g * per_group + i;
+        }
+    }
+    return -1;
+}
+
+// Allocate an inode and mark the inode to be in use in the bitmap.
+int allocate_inode() {
+    return allocate_inode_near(1);
+}
+
+// Allocate an inode close to the goal inode.
+int allocate_inode_near(int goal) {
+    struct ext2_super_block *sb = get_super_block();
+    if (goal < 1 || goal > sb->s_inodes_count) {
+        goal = 1;
+    }
+    int index = allocate_near(inode_group(goal), (goal - 1) % sb->s_inodes_per_group, 1);
+    return index == -1 ? ERR_NO_INODE : index;
+}
+
+// Allocate an block and mark the inode to be in use in the bitmap. 
+int allocate_block() {
+    return allocate_block_near(get_super_block()->s_first_data_block);
+}
+
+// Allocate a block at or after the goal block.
+int allocate_block_near(int goal) {
+    struct ext2_super_block *sb = get_super_block();
+    if (goal < sb->s_first_data_block || goal >= sb->s_blocks_count) {
+        goal = sb->s_first_data_block;
     }
-    
-    struct ext2_inode cur_inode = root_inode;
-
-    for (int i = 0; i < length - 1; i++) {
-        char* target = path[i+1];
-        int is_over = 0;
-        int has_find = 0;
-        int result = 0;
-        for (int k = 0; k < 12 && !is_over; k++) {
-            if (cur_inode.i_block[k] == 0) {
-                is_over = 0;
-                break;
+    int index = allocate_near(block_group(goal),
+                              (goal - sb->s_first_data_block) % sb->s_blocks_per_group, 0);
+    return index == -1 ? ERR_NO_BLOCK : sb->s_first_data_block + index;
+}
+
+/**
+ * Apply fn to the part of the block bitmaps covering count blocks from
+ * block start, one group at a time, adding the free counter updates when
+ * value is 0 or 1 (release or claim). Return the sum of fn's results.
+ * Helper function for claim_blocks, release_blocks and count_used_blocks.
+ */
+static int for_block_bits(unsigned int start, int count, int value) {
+    struct ext2_super_block *sb = get_super_block();
+    int total = 0;
+    while (count > 0) {
+        int g = block_group(start);
+        int first = group_first_block(g);
+        int n = first + blocks_in_group(g) - start;
+        if (n > count) {
+            n = count;
+        }
+        struct ext2_group_desc *gd = get_group_desc(g);
+        unsigned char *bitmap = disk + block_size * gd->bg_block_bitmap;
+        if (value == -1) {
+            total += count_bits(bitmap, start - first, n);
+        } else {
+            // the whole run is logged, whether or not each bit changes
+            log_dirty(DIRTY_BLOCKS, start, n);
+            int changed = change_bits(bitmap, start - first, n, value);
+            if (value) {
+                sb->s_free_blocks_count -= changed;
+                gd->bg_free_blocks_count -= changed;
+            } else {
+                sb->s_free_blocks_count += changed;
+                gd->bg_free_blocks_count += changed;
+                lower_first_free(first_free_block, g, start - first);
             }
-            result = find_in_block(cur_inode.i_block[k], target, 'd');
-            if (result > 0) {
-                has_find = 1;
-                break;
-            } else if (result == -2) {
-                return -ENOENT;
+            if (changed > 0) {
+                mark_bits_changed(bitmap, start - first, n, g);
             }
+            total += changed;
         }
-        if (has_find) {
-            cur_inode = inodes[result - 1];
-        }
-        if (has_find && i == length - 2) {
-            return result;
-        }    
+        start += n;
+        count -= n;
     }
-    return -ENOENT;
+    return total;
 }
 
+// Mark a run of blocks as in use
+int claim_blocks(unsigned int start, int count) {
+    return for_block_bits(start, count, 1);
+}
 
-// find the directory entry with name and given type in the given block
-
-int find_in_block(int block, char* name, char type) {
-    unsigned char *this_block = disk + block * EXT2_BLOCK_SIZE;
-    struct ext2_dir_entry *this_dir = (struct ext2_dir_entry*)this_block;
-    int size = 0;
-
-    while (size != EXT2_BLOCK_SIZE) {
-        size += this_dir->rec_len;
-        char this_type = 0;
-        if (this_dir->file_type == EXT2_FT_SYMLINK) {
-            this_type = 'l';
-        } else if (this_dir->file_type == EXT2_FT_REG_FILE) {
-            this_type = 'f';
-        } else if (this_dir->file_type == EXT2_FT_DIR) {
-            this_type = 'd';
-        } else { // should not reach here
-            continue;
-        }
+// Mark a run of blocks as free
+int release_blocks(unsigned int start, int count) {
+    return for_block_bits(start, count, 0);
+}
 
-        // compare the name of an entry with the name given
-        char this_name[EXT2_NAME_LEN];
-        strncpy(this_name, this_dir->name, EXT2_NAME_LEN);
-        this_name[this_dir->name_len] = '\0';
-        if (strcmp(this_name, name) == 0) {
+// Count the blocks of a run marked as in use
+int count_used_blocks(unsigned int start, int count) {
+    return for_block_bits(start, count, -1);
+}
 
-            // if the file is not deleted
-            if (this_dir->inode != 0) {
-                // and with the correct type
-                if (this_type == type) {
-                    return this_dir->inode;
-                } else {
-                    return ERR_WRONG_TYPE;
-                }
-            }
-        }
-        this_dir = (struct ext2_dir_entry*)(this_block + size);
+// Release the blocks of the runs
+void release_runs(struct block_run *runs, int run_count) {
+    for (int r = 0; r < run_count; r++) {
+        release_blocks(runs[r].start, runs[r].count);
     }
-    return ERR_NOT_EXIST;
 }
 
+// Allocate count blocks as runs of contiguous blocks, starting from the goal
+int allocate_blocks(int goal, int count, struct block_run **out_runs) {
+    struct ext2_super_block *sb = get_super_block();
+    *out_runs = NULL;
+    if (count == 0) {
+        return 0;
+    }
+    if (sb->s_free_blocks_count < count) {
+        return ERR_NO_BLOCK;
+    }
+    if (goal < sb->s_first_data_block || goal >= sb->s_blocks_count) {
+        goal = sb->s_first_data_block;
+    }
 
-// find the directory with given name and type in the given inode
+    int run_count = 0;
+    int run_capacity = 4;
+    struct block_run *runs = malloc(sizeof(struct block_run) * run_capacity);
+    int group_count = get_group_count();
+    int goal_group = block_group(goal);
+    int goal_index = goal - group_first_block(goal_group);
 
-int find_in_inode(int inode, char* name, char type) {
-    struct ext2_group_desc *bd = (struct ext2_group_desc*)(disk + (EXT2_BLOCK_SIZE) * 2);
-    struct ext2_inode *inodes = 
-    (struct ext2_inode*)(disk + (EXT2_BLOCK_SIZE)*bd->bg_inode_table);
-    struct ext2_inode this_inode = inodes[inode - 1];
-    int is_over = 0;
-    for (int i = 0; i < 12 && !is_over; i++) {
-        if (this_inode.i_block[i] == 0) {
-            is_over = 1;
-            break;
+    // same order as allocate_near: the goal group from the goal, the other
+    // groups, then the start of the goal group
+    for (int n = 0; n <= group_count && count > 0; n++) {
+        int g = (goal_group + n) % group_count;
+        int start = n == 0 ? goal_index : 0;
+        int end = blocks_in_group(g);
+        if (n == group_count) {
+            end = goal_index;
         }
-        int result = find_in_block(this_inode.i_block[i], name, type);
-        if (result != ERR_NOT_EXIST) {
-            return result;
+        struct ext2_group_desc *gd = get_group_desc(g);
+        unsigned char *bitmap = disk + block_size * gd->bg_block_bitmap;
+        // nothing is free below the hint, skip to it; while the runs are
+        // taken from the hint on, it moves along with them
+        int from_hint = start <= first_free_block[g];
+        if (from_hint) {
+            start = first_free_block[g];
         }
-    }
-    if (!is_over) {
-        if (this_inode.i_block[12] != 0) {
-            unsigned int *indirect_block = (unsigned int*)
-            (disk+EXT2_BLOCK_SIZE*this_inode.i_block[12]);
-            for (int i = 0; i < 256 && !is_over; i++) {
-                if (indirect_block[i] == 0) {
-                    is_over = 1;
-                    break;
-                }
-                int result = find_in_block(indirect_block[i], name, type);
-                if (result != ERR_NOT_EXIST) {
-                    return result;
+
+        while (count > 0 && gd->bg_free_blocks_count > 0) {
+            // a run goes from a free bit to the next used one
+            int first = find_next_bit(bitmap, start, end, 0);
+            if (first == -1) {
+                if (from_hint && end > first_free_block[g]) {
+                    first_free_block[g] = end;
                 }
+                break;
+            }
+            int last = find_next_bit(bitmap, first, end, 1);
+            if (last == -1) {
+                last = end;
+            }
+            int length = last - first < count ? last - first : count;
+
+            log_dirty(DIRTY_BLOCKS, group_first_block(g) + first, length);
+            change_bits(bitmap, first, length, 1);
+            sb->s_free_blocks_count -= length;
+            gd->bg_free_blocks_count -= length;
+            mark_bits_changed(bitmap, first, length, g);
+            if (run_count == run_capacity) {
+                run_capacity *= 2;
+                runs = realloc(runs, sizeof(struct block_run) * run_capacity);
+            }
+            runs[run_count].start = group_first_block(g) + first;
+            runs[run_count].count = length;
+            run_count++;
+            count -= length;
+            start = first + length;
+            if (from_hint) {
+                first_free_block[g] = start;
             }
         }
     }
-    return ERR_NOT_EXIST;
-}
 
-// Allocate an inode and mark the inode to be in use in the bitmap.
-int allocate_inode() {
-    struct ext2_group_desc *bd = (struct ext2_group_desc*)(disk + EXT2_BLOCK_SIZE * 2);
-    struct ext2_super_block *sb = (struct ext2_super_block *)(disk + 1024);
-    char *inode_bitmap = (char*)(disk + EXT2_BLOCK_SIZE * bd->bg_inode_bitmap);
-    int inode_amount = ((struct ext2_super_block *)(disk + 1024))->s_inodes_count;
-    
-    for (int i = 0; i < inode_amount; i++) {
-        if (!(*(inode_bitmap + i / 8) & (1 << (i % 8)))) {
-            *(inode_bitmap + i/8) |= 1 << (i % 8);
-            sb->s_free_inodes_count--;
-            bd->bg_free_inodes_count--;
-            return i;
-        }
+    // the free counters said there was enough space, but the bitmaps disagree
+    if (count > 0) {
+        release_runs(runs, run_count);
+        free(runs);
+        return ERR_NO_BLOCK;
     }
-    return ERR_NO_INODE;
+    *out_runs = runs;
+    return run_count;
 }
 
-// Allocate an block and mark the inode to be in use in the bitmap. 
-int allocate_block() {
-    struct ext2_group_desc *bd = (struct ext2_group_desc*)(disk + EXT2_BLOCK_SIZE * 2);
-    struct ext2_super_block *sb = (struct ext2_super_block *)(disk + 1024);
-    char *block_bitmap = (char*)(disk+ EXT2_BLOCK_SIZE * bd->bg_block_bitmap);
-    int block_count = ((struct ext2_super_block *)(disk + 1024))->s_blocks_count;
-    
-    for (int i = 0; i < block_count; i++) {
-        if (!(*(block_bitmap + i / 8) & (1 << (i % 8)))) {
-            *(block_bitmap + i/8) |= 1 << (i % 8);
-            sb->s_free_blocks_count--;
-            bd->bg_free_blocks_count--;
-            return i+1;
+// Find count free blocks in a row, starting from the goal
+int find_free_run(int goal, int count) {
+    struct ext2_super_block *sb = get_super_block();
+    if (count <= 0 || sb->s_free_blocks_count < count) {
+        return ERR_NO_BLOCK;
+    }
+    if (goal < sb->s_first_data_block || goal >= sb->s_blocks_count) {
+        goal = sb->s_first_data_block;
+    }
+    int group_count = get_group_count();
+    int goal_group = block_group(goal);
+    int goal_index = goal - group_first_block(goal_group);
+
+    // the goal group from the goal, the other groups, then the start of
+    // the goal group; a run does not go over the end of a group
+    for (int n = 0; n <= group_count; n++) {
+        int g = (goal_group + n) % group_count;
+        int start = n == 0 ? goal_index : 0;
+        int end = n == group_count ? goal_index + count - 1 : blocks_in_group(g);
+        if (end > blocks_in_group(g)) {
+            end = blocks_in_group(g);
+        }
+        struct ext2_group_desc *gd = get_group_desc(g);
+        if (gd->bg_free_blocks_count < count) {
+            continue;
+        }
+        unsigned char *bitmap = disk + block_size * gd->bg_block_bitmap;
+        if (start < first_free_block[g]) {
+            start = first_free_block[g];
+        }
+        while (start < end) {
+            int first = find_next_bit(bitmap, start, end, 0);
+            if (first == -1) {
+                break;
+            }
+            int last = find_next_bit(bitmap, first, end, 1);
+            if (last == -1) {
+                last = end;
+            }
+            if (last - first >= count) {
+                return group_first_block(g) + first;
+            }
+            start = last;
         }
     }
     return ERR_NO_BLOCK;
@@ -287,13 +1819,14 @@ int allocate_block() {
  * Return the pointer to the struct on success, return NULL on failure
  * Helper function for create_directory
  */ 
-static struct ext2_dir_entry* find_space_in_block(unsigned char *block, char *name) {
+ALWAYS_INLINE struct ext2_dir_entry* find_space_in_block_sized(const size_t bsize,
+                                                                unsigned char *block, char *name) {
     int size = 0;
     struct ext2_dir_entry *cur_entry = (struct ext2_dir_entry*)block;
     size += cur_entry->rec_len;
 
     // get to the last entry in block
-    while (size != EXT2_BLOCK_SIZE) {
+    while (size < bsize) {
         cur_entry = (struct ext2_dir_entry*)(block + size);
         size += cur_entry->rec_len;
     }
@@ -314,7 +1847,7 @@ static struct ext2_dir_entry* find_space_in_block(unsigned char *block, char *na
         cur_entry->rec_len = actual_length;
         cur_entry = (struct ext2_dir_entry*)(block + size + actual_length);
         size += actual_length;
-        cur_entry->rec_len = EXT2_BLOCK_SIZE - size;
+        cur_entry->rec_len = bsize - size;
         cur_entry->name_len = strlen(name);
         for (int i = 0; i < strlen(name); i++) {
             cur_entry->name[i] = name[i];
@@ -324,6 +1857,184 @@ static struct ext2_dir_entry* find_space_in_block(unsigned char *block, char *na
     return NULL;
 }
 
+struct ext2_dir_entry* find_space_in_block(unsigned char *block, char *name) {
+    return WITH_BLOCK_SIZE(find_space_in_block_sized, block, name);
+}
+
+
+/*
+ * Summary of the free space of directories: for each logical block of a
+ * directory, the size of the largest entry it can still take. It is built
+ * by a scan of the directory the first time an entry is added to it, and
+ * kept up to date by the functions here that add, remove or restore
+ * entries, so that a new entry goes in the first block with room for it
+ * and the blocks without room are not read. Indexed directories place
+ * their entries through htree.c and have no summary.
+ */
+#define DIR_SPACE_BUCKETS 1024
+#define DIR_SPACE_MAX 4096
+
+struct dir_space {
+    int directory;
+    unsigned int blocks;
+    int *room;
+    struct dir_space *next;
+};
+
+static struct dir_space *dir_space_table[DIR_SPACE_BUCKETS];
+static int dir_space_count;
+
+// Return the size taken by an entry with a name of name_len bytes
+static int dir_entry_size(int name_len) {
+    return (8 + name_len + 3) & ~3;
+}
+
+/**
+ * Return the size of the largest entry that fits in the block of a
+ * directory, in a removed entry or after a live one.
+ * Helper function for the directory space summary.
+ */
+ALWAYS_INLINE int block_room_sized(const size_t bsize, unsigned char *block) {
+    int room = 0;
+    int size = 0;
+    while (size < bsize) {
+        struct ext2_dir_entry *entry = (struct ext2_dir_entry*)(block + size);
+        if (entry->rec_len == 0) {
+            break;
+        }
+        int used = entry->inode == 0 ? 0 : dir_entry_size(entry->name_len);
+        if (entry->rec_len - used > room) {
+            room = entry->rec_len - used;
+        }
+        size += entry->rec_len;
+    }
+    return room;
+}
+static int block_room(unsigned char *block) {
+    return WITH_BLOCK_SIZE(block_room_sized, block);
+}
+
+/**
+ * Add an entry with name in the first place of the block with room for it,
+ * a removed entry or the space after a live one, leaving its inode and
+ * file_type unset. Return the entry, or NULL if there is no such place.
+ */
+ALWAYS_INLINE struct ext2_dir_entry* insert_in_block_sized(const size_t bsize,
+                                                           unsigned char *block, char *name) {
+    int name_len = strlen(name);
+    int needed = dir_entry_size(name_len);
+    int size = 0;
+    while (size < bsize) {
+        struct ext2_dir_entry *entry = (struct ext2_dir_entry*)(block + size);
+        if (entry->rec_len == 0) {
+            break;
+        }
+        int used = entry->inode == 0 ? 0 : dir_entry_size(entry->name_len);
+        if (entry->rec_len - used >= needed) {
+            if (used != 0) {
+                struct ext2_dir_entry *new_entry = (struct ext2_dir_entry*)(block + size + used);
+                new_entry->rec_len = entry->rec_len - used;
+                entry->rec_len = used;
+                entry = new_entry;
+            }
+            entry->inode = 0;
+            entry->file_type = 0;
+            entry->name_len = name_len;
+            memcpy(entry->name, name, name_len);
+            return entry;
+        }
+        size += entry->rec_len;
+    }
+    return NULL;
+}
+static struct ext2_dir_entry* insert_in_block(unsigned char *block, char *name) {
+    return WITH_BLOCK_SIZE(insert_in_block_sized, block, name);
+}
+
+// Return the link pointing to the summary of the directory, or to NULL
+static struct dir_space** dir_space_slot(int directory) {
+    struct dir_space **slot = &dir_space_table[(unsigned int)directory % DIR_SPACE_BUCKETS];
+    while (*slot != NULL && (*slot)->directory != directory) {
+        slot = &(*slot)->next;
+    }
+    return slot;
+}
+
+// Drop the summary of the directory, if it has one
+static void dir_space_forget(int directory) {
+    struct dir_space **slot = dir_space_slot(directory);
+    if (*slot != NULL) {
+        struct dir_space *old = *slot;
+        *slot = old->next;
+        free(old->room);
+        free(old);
+        dir_space_count--;
+    }
+}
+
+// Drop every summary
+static void dir_space_clear() {
+    for (int i = 0; i < DIR_SPACE_BUCKETS; i++) {
+        while (dir_space_table[i] != NULL) {
+            struct dir_space *next = dir_space_table[i]->next;
+            free(dir_space_table[i]->room);
+            free(dir_space_table[i]);
+            dir_space_table[i] = next;
+        }
+    }
+    dir_space_count = 0;
+}
+
+/**
+ * Return the summary of the directory (inode number), scanning its blocks
+ * for it if there is none yet.
+ */
+static struct dir_space* dir_space_get(int directory) {
+    struct dir_space **slot = dir_space_slot(directory);
+    if (*slot != NULL) {
+        return *slot;
+    }
+    if (dir_space_count == DIR_SPACE_MAX) {
+        dir_space_clear();
+        slot = dir_space_slot(directory);
+    }
+
+    struct ext2_inode *this_inode = get_inode(directory);
+    struct dir_space *space = malloc(sizeof(struct dir_space));
+    if (space == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    space->directory = directory;
+    space->blocks = this_inode->i_size / block_size;
+    // holes stay at 0, with no room
+    space->room = calloc(space->blocks > 0 ? space->blocks : 1, sizeof(int));
+    if (space->room == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    struct block_iter it;
+    unsigned int logical, block;
+    int count;
+    block_iter_init(&it, this_inode, BLOCK_ITER_DATA);
+    while ((count = block_iter_next(&it, &logical, &block)) > 0) {
+        for (int i = 0; i < count && logical + i < space->blocks; i++) {
+            space->room[logical + i] = block_room(disk + block_size * (block + i));
+        }
+    }
+    space->next = NULL;
+    *slot = space;
+    dir_space_count++;
+    return space;
+}
+
+// Update the summary of the directory, if it has one, for a changed block
+static void dir_space_update(int directory, unsigned int logical, int block) {
+    struct dir_space *space = *dir_space_slot(directory);
+    if (space != NULL && logical < space->blocks) {
+        space->room[logical] = block_room(disk + block_size * block);
+    }
+}
 
 /**
  * Create a new directory entry in the given inode with provided name.
@@ -333,133 +2044,94 @@ static struct ext2_dir_entry* find_space_in_block(unsigned char *block, char *na
  * Return a pointer to the new ext2_dir_entry on success, return NULL on failure.
  */ 
 struct ext2_dir_entry* create_directory(int inode, char *name) {
-    struct ext2_group_desc *bd = (struct ext2_group_desc*)(disk + (EXT2_BLOCK_SIZE) * 2);
+    struct ext2_inode *this_inode = get_inode(inode);
+    log_dirty(DIRTY_DIRECTORY, inode, 1);
+    // the caller fills in the entry after this returns
+    dentry_invalidate(inode, name);
 
-    struct ext2_inode *inodes = 
-    (struct ext2_inode*)(disk + (EXT2_BLOCK_SIZE)*bd->bg_inode_table);
-    struct ext2_inode *this_inode = inodes + (inode - 1);
-    int last_nonzero = find_last_nonzero(this_inode->i_block);
-    
-    // We don't deal with double/triple indirect
-    assert(last_nonzero < 14);
+    // an indexed directory decides itself where the entry goes
+    struct ext2_dir_entry *result = htree_add_entry(inode, name);
+    if (result != NULL) {
+        mark_changed(result, result->rec_len, CHANGE_METADATA);
+        return result;
+    }
 
-    if (last_nonzero <= 10) {
-        unsigned char *this_block = disk + EXT2_BLOCK_SIZE * (this_inode->i_block)[last_nonzero];
-        struct ext2_dir_entry *result = find_space_in_block(this_block, name);
-        if (result != NULL) {
-            return result;
+    // the first block with room for the entry, going by the summary
+    struct dir_space *space = dir_space_get(inode);
+    int needed = dir_entry_size(strlen(name));
+    for (unsigned int logical = 0; logical < space->blocks; logical++) {
+        if (space->room[logical] >= needed) {
+            unsigned int block = get_inode_block(this_inode, logical);
+            result = insert_in_block(disk + block_size * block, name);
+            // the new entry must count as used: it holds the directory's
+            // own number, as a new block's does, until the caller sets it
+            if (result != NULL) {
+                result->inode = inode;
+            }
+            space->room[logical] = block_room(disk + block_size * block);
+            if (result != NULL) {
+                mark_changed(result, result->rec_len, CHANGE_METADATA);
+                return result;
+            }
         }
-        //need a new block for parent directory
-        last_nonzero++;
-        int new_block = allocate_block();
-        if (new_block == -1) {
-            fprintf(stderr, "There is no space left on disk\n");
-            exit(-ENOSPC);
-        }
-        (this_inode->i_block)[last_nonzero] = new_block;
-        
-        // initialize the new disk block
-        memset(disk+EXT2_BLOCK_SIZE*new_block, 0, EXT2_BLOCK_SIZE);
-        struct ext2_dir_entry *this_dir = (struct ext2_dir_entry*)
-            (disk + EXT2_BLOCK_SIZE * new_block);
-        this_dir->inode = inode;
-        this_dir->name_len = strlen(name);
-        for (int i = 0; i < this_dir->name_len; i++) {
-            this_dir->name[i] = name[i];
-        }
-        // This is the only directory, set length to 1024
-        this_dir->rec_len = 1024;
-        return this_dir;
-
-    // the last nonzero block is the last direct block
-    } else if (last_nonzero == 11) {
-        unsigned char *this_block = disk + EXT2_BLOCK_SIZE * (this_inode->i_block)[last_nonzero];
-        
-        struct ext2_dir_entry *result = find_space_in_block(this_block, name);
+    }
+
+    // find the last block of the directory
+    unsigned int last = this_inode->i_size / block_size - 1;
+    unsigned int block = get_inode_block(this_inode, last);
+    //The last block should never be 0!
+    assert(block != 0);
+
+    // a directory growing out of its first block gets an index if the
+    // file system supports them, and from then on no summary
+    if (last == 0) {
+        result = htree_index_directory(inode, name);
         if (result != NULL) {
+            dir_space_forget(inode);
+            mark_changed(result, result->rec_len, CHANGE_METADATA);
             return result;
         }
+    }
 
-        //Need a new single indirect block for parent directory to store this new entry
-        int new_indirect_block = allocate_block();
-        if (new_indirect_block == -1) {
-            fprintf(stderr, "There is no space on the disk!\n");
-            exit(-ENOSPC);
-        }
-
-        // initialize the indirect block
-        memset(disk+EXT2_BLOCK_SIZE*new_indirect_block, 0, 1024);
-        (this_inode->i_block)[12] = new_indirect_block;
-        unsigned int *indirect_blocks = 
-        (unsigned int *)(disk + EXT2_BLOCK_SIZE * new_indirect_block);
-
-        // allocate a block to store this new entry
-        int new_block = allocate_block();
-        if (new_block == -1) {
-            fprintf(stderr, "There is no space on the disk\n");
-            exit(-ENOSPC);
-        }
-        indirect_blocks[0] = new_block;
-
-        // initialize the new block and add the new directory to it 
-        memset(disk+EXT2_BLOCK_SIZE*new_block, 0, 1024);
-        struct ext2_dir_entry *this_dir = (struct ext2_dir_entry*)
-            (disk + EXT2_BLOCK_SIZE * new_block);
-        this_dir->inode = inode;
-        this_dir->name_len = strlen(name);
-        for (int i = 0; i < this_dir->name_len; i++) {
-            this_dir->name[i] = name[i];
-        }
-        // This is the only directory, set length to 1024
-        this_dir->rec_len = 1024;
-        return this_dir;
-
-    // the last nonzero block is the single indirect block
-    } else if (last_nonzero == 12) {
-        unsigned int *blocks = (unsigned int*)(disk + EXT2_BLOCK_SIZE*(this_inode->i_block)[12]);
-        int last_nonzero = find_last_nonzero_1024(blocks);
-        unsigned char *this_block = disk + EXT2_BLOCK_SIZE * blocks[last_nonzero];
-        
-        struct ext2_dir_entry *result = find_space_in_block(this_block, name);
-        if (result != NULL) {
-            return result;
-        } else if (result == NULL && last_nonzero == 1023) {
-            fprintf(stderr, "Unable to handle the case that need double indirect\n");
-            exit(-ENOSPC);
-        }
-        last_nonzero++;
-
-        // allocate a new block
-        int new_block = allocate_block();
-        if (new_block == -1) {
-            fprintf(stderr, "There is no space on the disk\n");
-            exit(-ENOSPC);
-        }
-
-        // initialize the new block and put the new entry in it
-        blocks[last_nonzero] = new_block;
-        memset(disk+EXT2_BLOCK_SIZE*new_block, 0, 1024);
-        struct ext2_dir_entry *new_entry = (struct ext2_dir_entry*)
-        (disk + EXT2_BLOCK_SIZE * new_block);
-        new_entry->inode = inode;
-        new_entry->rec_len = 1024;
-        new_entry->name_len = strlen(name);
-        for (int i = 0; i < new_entry->name_len; i++) {
-            new_entry->name[i] = name[i];
-        }
-        return new_entry;
-    } else {
-        //should not reach here
-        assert(0);
+    //need a new block for parent directory, right after the last one if
+    //possible, along with any indirect block needed to reach it
+    struct block_pool pool = { .goal = block + 1 };
+    int new_block = map_new_block(this_inode, last + 1, &pool);
+    if (new_block == ERR_NO_BLOCK) {
+        fprintf(stderr, "There is no space left on disk\n");
+        exit(-ENOSPC);
     }
-    return NULL;
+    this_inode->i_size = (last + 2) * block_size;
+    int *room = realloc(space->room, (last + 2) * sizeof(int));
+    if (room == NULL) {
+        perror("realloc");
+        exit(1);
+    }
+    space->room = room;
+    space->room[last + 1] = block_size - needed;
+    space->blocks = last + 2;
+    
+    // initialize the new disk block
+    memset(disk+block_size*new_block, 0, block_size);
+    struct ext2_dir_entry *this_dir = (struct ext2_dir_entry*)
+        (disk + block_size * new_block);
+    this_dir->inode = inode;
+    this_dir->name_len = strlen(name);
+    for (int i = 0; i < this_dir->name_len; i++) {
+        this_dir->name[i] = name[i];
+    }
+    // This is the only directory, set length to the whole block
+    this_dir->rec_len = block_size;
+    mark_changed(this_dir, block_size, CHANGE_METADATA);
+    mark_changed(this_inode, sizeof(struct ext2_inode), CHANGE_METADATA);
+    return this_dir;
 }
 
 
 // Try delete the file in the block
 int delete_entry_in_block(int block, char *name) {
     int size = 0;
-    unsigned char *this_block = disk + EXT2_BLOCK_SIZE * block;
+    unsigned char *this_block = disk + block_size * block;
     struct ext2_dir_entry *last_entry = NULL;
     struct ext2_dir_entry *this_entry = (struct ext2_dir_entry*)this_block;
     
@@ -470,11 +2142,12 @@ int delete_entry_in_block(int block, char *name) {
     if (strcmp(this_name, name) == 0 && this_entry->inode != 0) {
         //set inode to 0 since it is the first entry
         this_entry->inode = 0;
+        mark_changed(this_entry, sizeof(struct ext2_dir_entry), CHANGE_METADATA);
         return DELETE_SUCCESS;
     }
 
     size += this_entry->rec_len;
-    while (size < EXT2_BLOCK_SIZE) {
+    while (size < block_size) {
         last_entry = this_entry;
         this_entry = (struct ext2_dir_entry*)(this_block + size);
         char this_name[this_entry->name_len + 1];
@@ -482,6 +2155,7 @@ int delete_entry_in_block(int block, char *name) {
         this_name[this_entry->name_len] = '\0';
         if (strcmp(this_name, name) == 0 && this_entry->inode != 0) {
             last_entry->rec_len += this_entry->rec_len;
+            mark_changed(last_entry, sizeof(struct ext2_dir_entry), CHANGE_METADATA);
             return DELETE_SUCCESS;
         }
         size += this_entry->rec_len;
@@ -490,6 +2164,172 @@ int delete_entry_in_block(int block, char *name) {
 }
 
 
+/**
+ * Look for the entry with name in a block of bsize bytes like
+ * lookup_in_block, and on the way note in *slot the offset of the first
+ * entry with room for a new entry of size needed after it (or in it, for a
+ * removed entry), if *slot is still -1.
+ * Helper function for lookup_or_reserve.
+ */
+ALWAYS_INLINE int scan_block_sized(const size_t bsize, int block, char *name, char *type,
+                                   int needed, int *slot) {
+    unsigned char *this_block = disk + bsize * block;
+    int name_len = strlen(name);
+    int size = 0;
+
+    while (size < bsize) {
+        struct ext2_dir_entry *this_dir = (struct ext2_dir_entry*)(this_block + size);
+        if (this_dir->rec_len == 0) {
+            break;
+        }
+        int used = this_dir->inode == 0 ? 0 : (8 + this_dir->name_len + 3) & ~3;
+        if (*slot == -1 && this_dir->rec_len - used >= needed) {
+            *slot = size;
+        }
+
+        char this_type = 0;
+        if (this_dir->file_type == EXT2_FT_SYMLINK) {
+            this_type = 'l';
+        } else if (this_dir->file_type == EXT2_FT_REG_FILE) {
+            this_type = 'f';
+        } else if (this_dir->file_type == EXT2_FT_DIR) {
+            this_type = 'd';
+        }
+        if (this_type != 0 && this_dir->inode != 0 && this_dir->name_len == name_len
+            && memcmp(this_dir->name, name, name_len) == 0) {
+            *type = this_type;
+            return this_dir->inode;
+        }
+        size += this_dir->rec_len;
+    }
+    return ERR_NOT_EXIST;
+}
+
+static int scan_block(int block, char *name, char *type, int needed, int *slot) {
+    return WITH_BLOCK_SIZE(scan_block_sized, block, name, type, needed, slot);
+}
+
+// Find the entry of the path, or where to add it, in one pass
+int lookup_or_reserve(char **path, int length, struct dir_slot *slot, char *type) {
+    int directory = trace_path(path, length - 1);
+    if (directory == -ENOENT) {
+        return -ENOENT;
+    }
+    char *name = path[length - 1];
+    slot->directory = directory;
+    slot->block = 0;
+    slot->logical = 0;
+    slot->offset = -1;
+
+    // a cached entry saves the walk; for a cached missing one,
+    // create_directory finds the room from the space summary
+    struct dentry *cached = *dentry_slot(directory, name);
+    if (cached != NULL) {
+        *type = cached->type;
+        return cached->inode;
+    }
+
+    int needed = (8 + strlen(name) + 3) & ~3;
+    int result = ERR_NOT_EXIST;
+    struct htree_cursor cursor;
+    int leaf = htree_first_leaf(&cursor, directory, name);
+    if (leaf != HTREE_UNINDEXED) {
+        // the entry can only go to the first leaf, its hash decides; the
+        // root block of "." and ".." has no room for entries
+        int first = strcmp(name, ".") == 0 || strcmp(name, "..") == 0 ? 0 : leaf;
+        while (leaf != 0) {
+            int offset = leaf == first ? -1 : 0;
+            result = scan_block(leaf, name, type, needed, &offset);
+            if (leaf == first && offset != -1) {
+                slot->block = leaf;
+                slot->offset = offset;
+            }
+            if (result != ERR_NOT_EXIST) {
+                break;
+            }
+            leaf = htree_next_leaf(&cursor);
+        }
+    } else {
+        // the index of a directory htree.c cannot use may still be in its
+        // blocks, so leave adding the entry to create_directory
+        int reserve = !(get_inode(directory)->i_flags & EXT2_INDEX_FL);
+        struct block_iter it;
+        unsigned int logical, block;
+        int count;
+        block_iter_init(&it, get_inode(directory), BLOCK_ITER_DATA);
+        while (result == ERR_NOT_EXIST && (count = block_iter_next(&it, &logical, &block)) > 0) {
+            for (int i = 0; i < count && result == ERR_NOT_EXIST; i++) {
+                int offset = reserve ? slot->offset : 0;
+                result = scan_block(block + i, name, type, needed, &offset);
+                if (reserve && slot->offset == -1 && offset != -1) {
+                    slot->logical = logical + i;
+                    slot->block = block + i;
+                    slot->offset = offset;
+                }
+            }
+        }
+    }
+    dentry_add(directory, name, result == ERR_NOT_EXIST ? 0 : result, *type);
+    return result == ERR_NOT_EXIST ? 0 : result;
+}
+
+// Add the entry at the place lookup_or_reserve found for it
+struct ext2_dir_entry* add_reserved_entry(struct dir_slot *slot, char *name) {
+    if (slot->block == 0) {
+        return create_directory(slot->directory, name);
+    }
+    log_dirty(DIRTY_DIRECTORY, slot->directory, 1);
+    dentry_invalidate(slot->directory, name);
+    struct ext2_dir_entry *holder = (struct ext2_dir_entry*)
+        (disk + block_size * slot->block + slot->offset);
+    struct ext2_dir_entry *entry = holder;
+    // a removed entry is taken over, a live one gives the end of its space
+    if (holder->inode != 0) {
+        int used = (8 + holder->name_len + 3) & ~3;
+        entry = (struct ext2_dir_entry*)((unsigned char*)holder + used);
+        entry->rec_len = holder->rec_len - used;
+        holder->rec_len = used;
+    }
+    // the directory's own number, as create_directory leaves it, so that
+    // the entry counts as used in the summary until the caller sets it
+    entry->inode = slot->directory;
+    entry->file_type = 0;
+    entry->name_len = strlen(name);
+    memcpy(entry->name, name, entry->name_len);
+    mark_changed(holder, holder->rec_len, CHANGE_METADATA);
+    dir_space_update(slot->directory, slot->logical, slot->block);
+    return entry;
+}
+
+// Delete the entry with name in the directory
+int delete_entry(int directory, char *name) {
+    struct block_iter it;
+    unsigned int logical, block;
+    int count;
+    log_dirty(DIRTY_DIRECTORY, directory, 1);
+    dentry_invalidate(directory, name);
+    struct htree_cursor cursor;
+    int leaf = htree_first_leaf(&cursor, directory, name);
+    if (leaf != HTREE_UNINDEXED) {
+        for (; leaf != 0; leaf = htree_next_leaf(&cursor)) {
+            if (delete_entry_in_block(leaf, name) == DELETE_SUCCESS) {
+                return DELETE_SUCCESS;
+            }
+        }
+        return ERR_NOT_EXIST;
+    }
+    block_iter_init(&it, get_inode(directory), BLOCK_ITER_DATA);
+    while ((count = block_iter_next(&it, &logical, &block)) > 0) {
+        for (int i = 0; i < count; i++) {
+            if (delete_entry_in_block(block + i, name) == DELETE_SUCCESS) {
+                dir_space_update(directory, logical + i, block + i);
+                return DELETE_SUCCESS;
+            }
+        }
+    }
+    return ERR_NOT_EXIST;
+}
+
 /**
  * Return the size after padding to be a multiple of 4.
  * Helper function for restore
@@ -505,7 +2345,7 @@ static int padding_size(int actual_length) {
 
 // Try restore the file with name in the given block
 int restore_entry_in_block(int block, char* name) {
-    unsigned char *this_block = disk + EXT2_BLOCK_SIZE * block;
+    unsigned char *this_block = disk + block_size * block;
     
     struct ext2_dir_entry *this_entry = (struct ext2_dir_entry*)this_block;
     char this_name[EXT2_NAME_LEN];
@@ -529,7 +2369,7 @@ int restore_entry_in_block(int block, char* name) {
 
     int total_size = 0;
     int this_size = padding_size(8+this_entry->name_len);
-    while (total_size < EXT2_BLOCK_SIZE) {
+    while (total_size < block_size) {
 
         // if there is no file deleted after this entry, go to the next
         if (this_size == this_entry->rec_len) {
@@ -561,6 +2401,8 @@ int restore_entry_in_block(int block, char* name) {
                     } else {
                         temp_entry->rec_len = this_entry->rec_len - size;
                         this_entry->rec_len = size;
+                        mark_changed(this_entry, this_entry->rec_len + temp_entry->rec_len,
+                                     CHANGE_METADATA);
                         return restore_inode_result;
                     }
                 }
@@ -576,84 +2418,199 @@ int restore_entry_in_block(int block, char* name) {
     return ERR_NOT_EXIST;
 }
 
+// Restore the entry with name in the directory
+int restore_entry(int directory, char *name) {
+    struct block_iter it;
+    unsigned int logical, block;
+    int count;
+    log_dirty(DIRTY_DIRECTORY, directory, 1);
+    dentry_invalidate(directory, name);
+    // the removed entry stays in the leaf its name hashes to, and the other
+    // blocks of an indexed directory are not entries
+    struct htree_cursor cursor;
+    int leaf = htree_first_leaf(&cursor, directory, name);
+    if (leaf != HTREE_UNINDEXED) {
+        for (; leaf != 0; leaf = htree_next_leaf(&cursor)) {
+            int result = restore_entry_in_block(leaf, name);
+            if (result != ERR_NOT_EXIST) {
+                return result;
+            }
+        }
+        return ERR_NOT_EXIST;
+    }
+    block_iter_init(&it, get_inode(directory), BLOCK_ITER_DATA);
+    while ((count = block_iter_next(&it, &logical, &block)) > 0) {
+        for (int i = 0; i < count; i++) {
+            int result = restore_entry_in_block(block + i, name);
+            if (result != ERR_NOT_EXIST) {
+                dir_space_update(directory, logical + i, block + i);
+                return result;
+            }
+        }
+    }
+    return ERR_NOT_EXIST;
+}
+
 /**
  * Try restore the inode and dateblock. Return RESTORE_SUCCESS on success;
  * RETURN ERR_OVERWRITTEN if the inode or the datablock in the inode
  * has been allocated.
  */ 
 static int restore_inode(int index) {
-    struct ext2_group_desc *bd = (struct ext2_group_desc*)(disk + (EXT2_BLOCK_SIZE) * 2);
-    struct ext2_super_block *sb = (struct ext2_super_block*)(disk + EXT2_BLOCK_SIZE);
-    char *block_bitmap = (char*)(disk+ EXT2_BLOCK_SIZE * bd->bg_block_bitmap);
-    char *inode_bitmap = (char*)(disk + EXT2_BLOCK_SIZE * bd->bg_inode_bitmap);
-    struct ext2_inode *inodes = (struct ext2_inode*)(disk + EXT2_BLOCK_SIZE*bd->bg_inode_table);
-    int block_count = 0;
-    
-    // check whether its inode is used by others 
-    if (!(*(inode_bitmap + ((index - 1) / 8)) & (1 << ((index - 1) % 8)))) {
-        *(inode_bitmap + ((index - 1) / 8)) |= (1 << ((index - 1) % 8));
-    } else {
-        return ERR_OVERWRITTEN;
-    }
+    struct ext2_inode* this_inode = get_inode(index);
 
-    // check whether its block has been overwritten, if not, restore the file
-    struct ext2_inode* this_inode = inodes + (index - 1);
-    int is_over = 0;
-    for (int i = 0; i < 12 && !is_over; i++) {
-        if (this_inode->i_block[i] == 0) {
-            is_over = 1;
-            break;
-        }
-        int this_block = this_inode->i_block[i];
+    struct block_iter it;
+    unsigned int logical, block;
+    int count;
 
-        if (!(*(block_bitmap + (this_block-1) / 8) & (1 << ((this_block - 1) % 8)))) {
-            *(block_bitmap + (this_block - 1) / 8) |= (1 << ((this_block - 1) % 8));
-            block_count++;
-        } else {
+    // check whether its inode or any of its blocks (data or indirect) is used
+    // by others before changing anything
+    if (inode_in_use(index)) {
+        return ERR_OVERWRITTEN;
+    }
+    block_iter_init(&it, this_inode, BLOCK_ITER_ALL);
+    while ((count = block_iter_next(&it, &logical, &block)) > 0) {
+        if (count_used_blocks(block, count) > 0) {
             return ERR_OVERWRITTEN;
         }
     }
 
-    // update info after restore the file
-    if (is_over) {
-        bd->bg_free_blocks_count -= block_count;
-        sb->s_free_blocks_count -= block_count;
-        bd->bg_free_inodes_count--;
-        sb->s_free_inodes_count--;
-        this_inode->i_dtime = 0;
-        this_inode->i_links_count++;
-        return RESTORE_SUCCESS; 
+    // restore the file
+    claim_inode(index);
+    block_iter_init(&it, this_inode, BLOCK_ITER_ALL);
+    while ((count = block_iter_next(&it, &logical, &block)) > 0) {
+        claim_blocks(block, count);
+    }
+    this_inode->i_dtime = 0;
+    this_inode->i_links_count++;
+    mark_changed(this_inode, sizeof(struct ext2_inode), CHANGE_METADATA);
+    return RESTORE_SUCCESS; 
+}
+
+
+/**
+ * Order of the entries of a directory for compact_directory, with their
+ * hash for COMPACT_BY_HASH.
+ */
+struct compact_entry {
+    unsigned int hash;
+    struct ext2_dir_entry *entry;
+};
+
+static int compare_names(const void *a, const void *b) {
+    struct ext2_dir_entry *x = ((struct compact_entry*)a)->entry;
+    struct ext2_dir_entry *y = ((struct compact_entry*)b)->entry;
+    int len = x->name_len < y->name_len ? x->name_len : y->name_len;
+    int result = memcmp(x->name, y->name, len);
+    return result != 0 ? result : x->name_len - y->name_len;
+}
+
+static int compare_hashes(const void *a, const void *b) {
+    unsigned int x = ((struct compact_entry*)a)->hash;
+    unsigned int y = ((struct compact_entry*)b)->hash;
+    if (x != y) {
+        return x < y ? -1 : 1;
+    }
+    return compare_names(a, b);
+}
+
+// Pack the live entries of the directory into its first blocks
+int compact_directory(int directory, int order) {
+    struct ext2_inode *this_inode = get_inode(directory);
+    log_dirty(DIRTY_DIRECTORY, directory, 1);
+    unsigned int blocks = this_inode->i_size / block_size;
+
+    // copy the live entries out, in the order of the blocks
+    unsigned char *copy = malloc((size_t)blocks * block_size);
+    struct compact_entry *entries = malloc(((size_t)blocks * block_size / 12 + 1) *
+                                           sizeof(struct compact_entry));
+    if (copy == NULL || entries == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    int count = 0;
+    size_t copied = 0;
+    struct block_iter it;
+    unsigned int logical, block;
+    int run;
+    block_iter_init(&it, this_inode, BLOCK_ITER_DATA);
+    while ((run = block_iter_next(&it, &logical, &block)) > 0) {
+        for (int i = 0; i < run; i++) {
+            unsigned char *this_block = disk + block_size * (block + i);
+            int size = 0;
+            while (size < block_size) {
+                struct ext2_dir_entry *entry = (struct ext2_dir_entry*)(this_block + size);
+                if (entry->rec_len == 0) {
+                    break;
+                }
+                if (entry->inode != 0) {
+                    int length = dir_entry_size(entry->name_len);
+                    memcpy(copy + copied, entry, length);
+                    entries[count].entry = (struct ext2_dir_entry*)(copy + copied);
+                    entries[count].hash = 0;
+                    count++;
+                    copied += length;
+                }
+                size += entry->rec_len;
+            }
+        }
     }
 
-    // check single indirect block
-    if (this_inode->i_block[12] != 0) {
-        int temp = this_inode->i_block[12];
-        if (!(*(block_bitmap + (temp - 1) / 8) & (1 << ((temp - 1) % 8)))) {
-            *(block_bitmap + (temp - 1) / 8) |= (1 << ((temp - 1) % 8));
-            block_count++;
-        } else {
-            return ERR_OVERWRITTEN;
+    // '.' and '..' stay first
+    int first = 0;
+    while (first < count && first < 2 && entries[first].entry->name[0] == '.' &&
+           entries[first].entry->name_len == first + 1) {
+        first++;
+    }
+    if (order == COMPACT_BY_NAME) {
+        qsort(entries + first, count - first, sizeof(struct compact_entry), compare_names);
+    } else if (order == COMPACT_BY_HASH) {
+        int version = htree_default_version();
+        for (int i = first; i < count; i++) {
+            entries[i].hash = htree_hash(entries[i].entry->name, entries[i].entry->name_len,
+                                         version);
         }
-        unsigned int *indirect_block = (unsigned int*)(disk+EXT2_BLOCK_SIZE*this_inode->i_block[12]);
-        for (int i = 0; i < 256 && !is_over; i++) {
-            if (indirect_block[i] == 0) {
-                is_over = 1;
-                break;
+        qsort(entries + first, count - first, sizeof(struct compact_entry), compare_hashes);
+    }
+
+    // write them back densely, the last entry of a block taking the rest
+    // of it; the blocks of an index become ordinary blocks
+    struct ext2_dir_entry *previous = NULL;
+    unsigned int target = 0;
+    int size = block_size;
+    unsigned char *this_block = NULL;
+    for (int i = 0; i < count; i++) {
+        int length = dir_entry_size(entries[i].entry->name_len);
+        if (size + length > block_size) {
+            if (previous != NULL) {
+                previous->rec_len += block_size - size;
             }
-            int this_block = indirect_block[i];
-            if (!(*(block_bitmap + (this_block - 1) / 8) & (1 << ((this_block - 1) % 8)))) {
-                *(block_bitmap + (this_block - 1) / 8) |= (1 << ((this_block - 1) % 8));
-                block_count++;
-            } else {
-                return ERR_OVERWRITTEN;
+            // holes are skipped
+            while (target < blocks && get_inode_block(this_inode, target) == 0) {
+                target++;
             }
+            this_block = disk + block_size * get_inode_block(this_inode, target);
+            target++;
+            size = 0;
         }
+        previous = (struct ext2_dir_entry*)(this_block + size);
+        memcpy(previous, entries[i].entry, length);
+        previous->rec_len = length;
+        mark_changed(previous, length, CHANGE_METADATA);
+        size += length;
     }
-    bd->bg_free_blocks_count -= block_count;
-    sb->s_free_blocks_count -= block_count;
-    bd->bg_free_inodes_count--;
-    sb->s_free_inodes_count--;
-    this_inode->i_dtime = 0;
-    this_inode->i_links_count++;
-    return RESTORE_SUCCESS; 
+    if (previous != NULL) {
+        previous->rec_len += block_size - size;
+    }
+    free(entries);
+    free(copy);
+
+    // the emptied blocks go, with the indirect blocks only they needed
+    unsigned int old_blocks = this_inode->i_blocks;
+    truncate_inode_blocks(this_inode, target);
+    this_inode->i_size = target * block_size;
+    this_inode->i_flags &= ~EXT2_INDEX_FL;
+    mark_changed(this_inode, sizeof(struct ext2_inode), CHANGE_METADATA);
+    dir_space_forget(directory);
+    return (old_blocks - this_inode->i_blocks) / (block_size / 512);
 }
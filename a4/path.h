@@ -6,8 +6,195 @@
 #define RESTORE_SUCCESS 0
 #define ERR_OVERWRITTEN -4
 
+// Access pattern hints for open_image
+#define IMAGE_RANDOM 0
+#define IMAGE_SEQUENTIAL 1
+// Added to either: open the image read-only, with a private copy-on-write
+// mapping, so changes never reach the file
+#define IMAGE_PRIVATE 2
+// Added to either: make no records in the dirty log, for the checker, whose
+// repairs settle what the log names
+#define IMAGE_UNLOGGED 4
+
 extern unsigned char *disk;
 
+/**
+ * A run of count contiguous blocks, starting from block start.
+ */
+struct block_run {
+    unsigned int start;
+    unsigned int count;
+};
+
+// Block size of the image and number of block pointers in an indirect block,
+// both read from the super block by open_image
+extern size_t block_size;
+extern int pointers_per_block;
+
+/**
+ * Open the image file and map all of it into disk. The size of the mapping
+ * comes from the file itself and is checked against the size recorded in the
+ * super block. access is IMAGE_RANDOM for tools that only look up a few paths
+ * and IMAGE_SEQUENTIAL for tools that scan the whole image; it is passed to
+ * the kernel as a hint, along with a request for huge pages where supported.
+ * With IMAGE_PRIVATE added, the file is opened read-only and what is written
+ * to disk stays in memory, as do the syncs.
+ * Print the error and exit on failure, return the file descriptor of the
+ * image on success.
+ */
+int open_image(char *path, int access);
+
+/**
+ * Write the whole mapping made by open_image back to the image file and wait
+ * for it. The tools write back only what they changed, with sync_changes.
+ */
+void sync_image();
+
+/**
+ * Write the part of the mapping made by open_image holding length bytes from
+ * start back to the image file and wait for it.
+ */
+void sync_region(void *start, size_t length);
+
+// Kinds of changes to the mapping, for mark_changed
+#define CHANGE_METADATA 0   // super block, descriptors, bitmaps, inodes, directories
+#define CHANGE_DATA 1       // contents of files and symbolic links
+
+/**
+ * Note that the length bytes of the mapping from start were changed, so
+ * that sync_changes writes back the blocks holding them. The functions here
+ * that change the image note their changes themselves; the tools note the
+ * fields and data they write directly.
+ */
+void mark_changed(const void *start, size_t length, int kind);
+
+/**
+ * Write the records of the dirty log made since the last call, then write
+ * back the blocks changed since the last call, in block order, and wait for
+ * them; then forget them. What is written depends on EXT2_SYNC in
+ * the environment: "none" leaves it all to the kernel, "metadata" writes
+ * only the metadata, and "all" (the default) writes the data first, then the
+ * metadata, so that no metadata written refers to data that is not; any
+ * other value is reported and taken as "all".
+ * Tools call this once at the end of their operations.
+ */
+void sync_changes();
+
+// Kinds of records in the dirty log of an image
+#define DIRTY_INODE 'i'       // an inode allocated, released or moved
+#define DIRTY_DIRECTORY 'd'   // a directory whose entries changed
+#define DIRTY_BLOCKS 'b'      // a run of blocks allocated or released
+
+struct dirty_record {
+    char kind;
+    unsigned int number;      // inode number, or first block of the run
+    int count;                // blocks in the run, 1 for the others
+};
+
+/**
+ * Append a record of the change to the dirty log of the image, the file
+ * with ".dirty" added to its name, for ext2_checker --incremental. The
+ * allocation and directory functions here record their changes themselves,
+ * before making them. The records are kept in memory and written at once
+ * by sync_changes, which makes them durable before the image, or when the
+ * tool exits. Print the error and exit if the log cannot be opened, or
+ * cannot be written by sync_changes. Nothing is recorded for an image
+ * opened with IMAGE_PRIVATE or IMAGE_UNLOGGED.
+ */
+void log_dirty(char kind, unsigned int number, int count);
+
+/**
+ * Read the dirty log of the image into a new array of records in *records,
+ * to be freed by the caller.
+ * Return the number of records, 0 when there is no log.
+ */
+int read_dirty_log(struct dirty_record **records);
+
+/**
+ * Remove the dirty log of the image, once all of it is known to be
+ * consistent.
+ */
+void clear_dirty_log();
+
+/**
+ * Return a pointer to the super block of the image.
+ */
+struct ext2_super_block* get_super_block();
+
+/**
+ * Return the number of block groups in the image.
+ */
+int get_group_count();
+
+/**
+ * Return a pointer to the descriptor of the given block group.
+ * Note: group is an index in the descriptor table(i.e. starts from 0)
+ */
+struct ext2_group_desc* get_group_desc(int group);
+
+/**
+ * Return a pointer to the inode with the given inode number, in whichever
+ * group's inode table it lives.
+ * Note: the inode number provided should not be minus 1.
+ */
+struct ext2_inode* get_inode(int inode);
+
+/**
+ * Return the block group the inode with the given inode number belongs to.
+ */
+int inode_group(int inode);
+
+/**
+ * Return the block group the given block belongs to.
+ */
+int block_group(int block);
+
+/**
+ * Return the number of blocks in the given block group. This is
+ * s_blocks_per_group except for the last group, which may be shorter.
+ */
+int blocks_in_group(int group);
+
+/**
+ * Return 1 if the inode with given inode number is marked as in use in the
+ * inode bitmap of its group, 0 otherwise.
+ */
+int inode_in_use(int inode);
+
+/**
+ * Return 1 if the given block is marked as in use in the block bitmap of its
+ * group, 0 otherwise.
+ */
+int block_in_use(int block);
+
+/**
+ * Mark the inode with given inode number as in use and update the free inode
+ * counters in the super block and its group descriptor.
+ * Return 1 if the inode was free before, 0 if it was already in use (in which
+ * case nothing is changed).
+ */
+int claim_inode(int inode);
+
+/**
+ * Mark the given block as in use and update the free block counters in the
+ * super block and its group descriptor.
+ * Return 1 if the block was free before, 0 if it was already in use (in which
+ * case nothing is changed).
+ */
+int claim_block(int block);
+
+/**
+ * Mark the inode with given inode number as free and update the free inode
+ * counters. Nothing is changed if the inode is already free.
+ */
+void release_inode(int inode);
+
+/**
+ * Mark the given block as free and update the free block counters.
+ * Nothing is changed if the block is already free.
+ */
+void release_block(int block);
+
 /**
  * try find the directory entry with name and given type in the given block.
  * Return the inode number of the file on found.
@@ -16,6 +203,13 @@ extern unsigned char *disk;
  */ 
 int find_in_block(int block, char* name, char type);
 
+/**
+ * Find the entry with name in the given block, whatever its type.
+ * Set *type to its type ('f', 'd' or 'l') and return its inode number on
+ * found, return ERR_NOT_EXIST otherwise.
+ */
+int lookup_in_block(int block, char* name, char *type);
+
 /**
  * parse the path provided and return an array of all the folder tokens in 
  * the path, change length to the length of the path. Note that the first 
@@ -26,8 +220,14 @@ int find_in_block(int block, char* name, char type);
  */
 char** parse_path(char *path, int *length);
 
+/**
+ * Free the array of length tokens returned by parse_path.
+ */
+void free_path(char **path, int length);
+
 /**
  * Trace the path and return the inode number of the target directory.
+ * Every token must name a directory, looked up with find_in_inode.
  * Input: path is the path want to trace, length is the number of token in 
  * the path, include the "/"
  * Example: input path: /, usr, local, return the inode number of local.
@@ -42,32 +242,275 @@ int trace_path(char** path, int length);
  * Return the inode number of the file on found.
  * Return ERR_NOT_EXIST if the name doesn't exist, 
  * Return ERR_WRONG_TYPE if the name exist but no as given type
+ * Lookups are cached, including the names that do not exist, so asking again
+ * does not read the directory again; create_directory, delete_entry and
+ * restore_entry keep the cache up to date.
  */ 
 int find_in_inode(int inode, char* name, char type);
 
 /**
  * Allocate an inode and mark the inode to be in use in the bitmap.
+ * The groups are searched in order, starting from group 0.
  * Return the inode index on success, return ERR_NO_BLOCK if no inode is available
- * Note: the number returned in this function is the actual index in the 
- * inodes array.
+ * Note: the number returned in this function is the inode number minus 1,
+ * use get_inode(index + 1) to get the inode.
  */
 int allocate_inode(); 
 
 /**
  * Allocate an block and mark the inode to be in use in the bitmap. 
+ * The groups are searched in order, starting from group 0.
  * Return the block index on success, return ERR_NO_INODE if no block is available.
  */ 
 int allocate_block();
 
+/**
+ * Allocate an inode as close as possible to the goal inode: the search
+ * starts at the goal in its group's bitmap and goes on through the next
+ * groups, so passing the parent directory keeps a file's inode in the same
+ * group as its directory.
+ * Return the inode index on success, return ERR_NO_INODE if no inode is
+ * available. Note: like allocate_inode, this returns the inode number minus 1.
+ */
+int allocate_inode_near(int goal);
+
+/**
+ * Allocate a block as close as possible to the goal block: the first free
+ * block at or after the goal in its group, or else in the following groups.
+ * Passing the block right after a file's previous block keeps the file
+ * contiguous.
+ * Return the block index on success, return ERR_NO_BLOCK if no block is available.
+ */
+int allocate_block_near(int goal);
+
+/**
+ * Allocate count blocks in a single pass over the block bitmaps, in the same
+ * order as allocate_block_near searches them, taking whole runs of free
+ * blocks at once. The free counters are updated once per run.
+ * The runs, in the order they were found, are stored in a dynamically
+ * allocated array put in out_runs that needs to be freed.
+ * Return the number of runs on success, return ERR_NO_BLOCK if there are
+ * fewer than count free blocks, in which case nothing is allocated.
+ */
+int allocate_blocks(int goal, int count, struct block_run **out_runs);
+
+/**
+ * Find count free blocks in a row in one group, looking from the goal on as
+ * allocate_near does. The blocks are not marked as in use.
+ * Return the first block on success, return ERR_NO_BLOCK if there is no such
+ * run.
+ */
+int find_free_run(int goal, int count);
+
+/**
+ * Mark count blocks from block start as in use and update the free block
+ * counters. Return the number of blocks that were free before.
+ */
+int claim_blocks(unsigned int start, int count);
+
+/**
+ * Mark count blocks from block start as free and update the free block
+ * counters. Return the number of blocks that were in use before.
+ */
+int release_blocks(unsigned int start, int count);
+
+/**
+ * Return the number of bits set among count bits of the bitmap (a bitmap
+ * block of the image) starting from bit start. The bitmap is read 64 bits
+ * at a time, so it must be readable up to the next multiple of 64 bits.
+ */
+int count_bits(const unsigned char *bitmap, int start, int count);
+
+/**
+ * Return the number of blocks marked as in use among count blocks from
+ * block start.
+ */
+int count_used_blocks(unsigned int start, int count);
+
+/**
+ * Mark the blocks of the runs as free again and update the free counters.
+ */
+void release_runs(struct block_run *runs, int run_count);
+
+/**
+ * Return the first block of the given group, a good goal for the first data
+ * block of an inode living in that group.
+ */
+int group_first_block(int group);
+
+/**
+ * Blocks handed out by take_block: first the runs reserved by allocate_blocks
+ * (runs may be NULL), in order, then blocks allocated one at a time as close
+ * as possible after the last block taken. goal is where that search starts.
+ */
+struct block_pool {
+    struct block_run *runs;
+    int run_count;
+    int run;
+    int offset;
+    int goal;
+};
+
+/**
+ * Take the next block from the pool.
+ * Return the block index on success, return ERR_NO_BLOCK if no block is available.
+ */
+int take_block(struct block_pool *pool);
+
+/**
+ * Return the size in bytes of the file of the inode, including the high 32
+ * bits kept in i_dir_acl for regular files.
+ */
+unsigned long long get_inode_size(struct ext2_inode *inode);
+
+/**
+ * Set the size in bytes of the file of the inode. Sizes of 2 GiB or more
+ * also turn on the large file feature in the super block.
+ */
+void set_inode_size(struct ext2_inode *inode, unsigned long long size);
+
+/**
+ * Return the block holding logical block `logical` (counted from 0) of the
+ * inode, going through the single, double or triple indirect block as needed.
+ * Return 0 if the logical block is not mapped.
+ */
+unsigned int get_inode_block(struct ext2_inode *inode, unsigned int logical);
+
+/**
+ * Map logical block `logical` of the inode to a new block taken from the
+ * pool. Any missing indirect block on the way is taken from the pool first
+ * and zeroed, so a file written in order is laid out the way ext2 lays it
+ * out: each indirect block right before the blocks it points to.
+ * i_blocks is updated for every block taken.
+ * Return the new block on success, return ERR_NO_BLOCK if the pool runs out
+ * or the logical block is beyond the triple indirect block.
+ */
+int map_new_block(struct ext2_inode *inode, unsigned int logical, struct block_pool *pool);
+
+/**
+ * Return the number of indirect blocks (single, double and triple) a file
+ * of data_blocks blocks without holes needs.
+ */
+int count_indirect_blocks(unsigned int data_blocks);
+
+/**
+ * Return the number of indirect blocks logical block logical needs that are
+ * not already needed by logical block previous (-1 for none). Summed over
+ * the mapped blocks of a file in increasing order, it counts the indirect
+ * blocks of a file with holes.
+ */
+int count_new_indirect_blocks(long long previous, unsigned int logical);
+
+/**
+ * Return 1 if the length bytes of data are all zero, 0 otherwise.
+ */
+int is_zero_block(const unsigned char *data, size_t length);
+
+// Flags for block_iter_init
+#define BLOCK_ITER_DATA 0
+#define BLOCK_ITER_ALL 1
+
+/**
+ * Iterator over the blocks of an inode, see block_iter_init. The fields are
+ * private to path.c.
+ */
+struct block_iter {
+    struct ext2_inode *inode;
+    int all;
+    unsigned int next;
+    unsigned int end;
+    unsigned int *table;
+    int index;
+    int table_len;
+    unsigned int seen[4];
+    unsigned int meta;
+    unsigned int pending_logical;
+    unsigned int pending_block;
+    int pending_count;
+};
+
+/**
+ * Start iterating over the blocks of the inode, up to its i_size, through
+ * the direct blocks and the single, double and triple indirect blocks.
+ * The block pointers are read in place in the image, nothing is copied.
+ * With BLOCK_ITER_DATA only the data blocks are returned; holes (zero
+ * entries, at any level) are skipped. With BLOCK_ITER_ALL the indirect blocks
+ * are returned too, each one before the blocks it lists.
+ */
+void block_iter_init(struct block_iter *it, struct ext2_inode *inode, int flags);
+
+/**
+ * Get the next run of blocks that are contiguous on disk (and, for
+ * BLOCK_ITER_DATA, in the file): block is the first block of the run and
+ * logical its position in the file. With BLOCK_ITER_ALL a run may mix
+ * indirect and data blocks, so logical is only an indication.
+ * Return the number of blocks in the run, or 0 when there are no more.
+ */
+int block_iter_next(struct block_iter *it, unsigned int *logical, unsigned int *block);
+
+/**
+ * Release every block used by the inode, data and indirect blocks, and
+ * update the free block counters.
+ */
+void release_inode_blocks(struct ext2_inode *inode);
+
+/**
+ * Release the data blocks of the inode from logical block keep on, along
+ * with the indirect blocks no longer needed to map the others, and update
+ * its i_blocks. The i_size of the inode is left to the caller.
+ */
+void truncate_inode_blocks(struct ext2_inode *inode, unsigned int keep);
+
 /**
  * Create a new directory entry in the given inode with provided name.
- * This function simple find the space, but left inode and file_type unset.
+ * This function simple find the space, but left inode and file_type unset;
+ * until the caller sets it, the inode may hold the directory's own number.
+ * The entry goes in the first block with room for it, found through a
+ * summary of the free space of the directory kept across calls.
  * Note: 1. the inode number provided must be an entry
  *       2. the inode number provided should be index(i.e. don't need to minus 1)
  * Return a pointer to the new ext2_dir_entry on success, return NULL on failure.
  */ 
 struct ext2_dir_entry* create_directory(int inode, char *name);
 
+/**
+ * The place found for a new entry in a directory by lookup_or_reserve.
+ */
+struct dir_slot {
+    int directory;        // inode number of the directory
+    unsigned int block;   // block with room for the entry, 0 if there is none
+    unsigned int logical; // index of that block in the directory
+    int offset;           // offset in block of the entry to share space with
+};
+
+/**
+ * Resolve the directory of the path (all tokens but the last, as
+ * trace_path), then look for the last token in it. The same walk over the
+ * directory records in slot the first place with room for a new entry with
+ * that name (for an indexed directory, in the leaf of its hash). When the
+ * name is already known to be missing, there is no walk and the slot is
+ * left empty for add_reserved_entry.
+ * Return the inode number of the entry, with *type set to its type ('f',
+ * 'd' or 'l'), if it exists; return 0 if it does not, after filling slot;
+ * return -ENOENT if the directory path is invalid.
+ */
+int lookup_or_reserve(char **path, int length, struct dir_slot *slot, char *type);
+
+/**
+ * Add the entry with name at the place lookup_or_reserve found, or through
+ * create_directory if it found none. Like create_directory, the inode and
+ * file_type of the entry are left for the caller to set. The directory must
+ * not have changed since lookup_or_reserve.
+ */
+struct ext2_dir_entry* add_reserved_entry(struct dir_slot *slot, char *name);
+
+/**
+ * Try add an entry with name after the last entry of the block (a pointer to
+ * its data), leaving its inode and file_type unset.
+ * Return the new entry, or NULL if there is not enough space at the end.
+ */
+struct ext2_dir_entry* find_space_in_block(unsigned char *block, char *name);
+
 /**
  * Try delete the file in the block;
  * Return DELETE_SUCCESS on success, return ERR_NOT_EXIST on not found
@@ -81,4 +524,51 @@ int delete_entry_in_block(int block, char *name);
  * Return ERR_OVERWRITTEN if the entry inode or the datablock in the inode
  * has been reallocated
  */
-int restore_entry_in_block(int block, char *name);
\ No newline at end of file
+int restore_entry_in_block(int block, char *name);
+
+/**
+ * Delete the entry with name from the given directory (inode number), looking
+ * through all of its blocks.
+ * Return DELETE_SUCCESS on success, return ERR_NOT_EXIST on not found
+ */
+int delete_entry(int directory, char *name);
+
+/**
+ * Restore the entry with name in the given directory (inode number), looking
+ * through all of its blocks.
+ * Return the result of restore_entry_in_block for the block it is found in,
+ * or ERR_NOT_EXIST if no block has it
+ */
+int restore_entry(int directory, char *name);
+
+#define COMPACT_KEEP_ORDER 0
+#define COMPACT_BY_NAME 1
+#define COMPACT_BY_HASH 2
+
+/**
+ * Pack the live entries of the directory (inode number) into as few blocks
+ * as they fit in, in their current order or sorted by name or by hash
+ * (COMPACT_*), and release the blocks left empty, fixing i_size and
+ * i_blocks. Removed entries are dropped for good, and so is the index of an
+ * indexed directory.
+ * Return the number of blocks released.
+ */
+int compact_directory(int directory, int order);
+
+/**
+ * Return the number of runs of contiguous blocks the blocks of the inode,
+ * data and indirect, make in the order they are mapped; 1 for a file laid
+ * out in one piece, 0 for one without blocks.
+ */
+int count_fragments(struct ext2_inode *inode);
+
+/**
+ * Move the data blocks of the inode, and the indirect blocks mapping them,
+ * to one run of free blocks found from the goal, laid out as map_new_block
+ * does. The data, the new indirect blocks and the bitmaps are copied and
+ * written back first, whatever EXT2_SYNC says; only then does the inode
+ * switch to the new blocks, and the old ones are released.
+ * Return the first block of the new run, or ERR_NO_BLOCK if there is no run
+ * of free blocks long enough.
+ */
+int relocate_inode_blocks(struct ext2_inode *inode, int goal);
\ No newline at end of file